@@ -1,3 +1,5 @@
+import java.util.LinkedHashMap;
+import java.util.Map;
 import java.util.concurrent.Executors;
 import java.util.concurrent.Future;
 import java.util.concurrent.ScheduledExecutorService;
@@ -29,6 +31,40 @@ public class Heapz {
         }, seconds, TimeUnit.SECONDS);
     }
 
+    /**
+     * Profiles the allocations of the current thread while task runs, other
+     * threads are not affected. Returns an allocation profile of the scope,
+     * its allocations are not part of a running sampling session.
+     */
+    public static byte[] profile(Runnable task) {
+        byte[] result;
+        Heapz.beginScope();
+        try {
+            task.run();
+        } finally {
+            result = Heapz.endScope();
+        }
+        return result;
+    }
+
+    /**
+     * What the agent has cost since it was loaded: for each timed operation
+     * (callback, stack_trace, symbolize, lock_wait, forced_gc, liveness,
+     * serialize) its count, total, p50, p99 and max in nanoseconds, counts
+     * of samples, symbol misses, filtered and dropped samples, and the
+     * approximate memory_bytes held by the agent.
+     */
+    public static Map<String, Long> getAgentStats() {
+        var stats = new LinkedHashMap<String, Long>();
+        for (var line : agentStats().split("\n")) {
+            var separator = line.indexOf('=');
+            if (separator > 0) {
+                stats.put(line.substring(0, separator), Long.parseUnsignedLong(line.substring(separator + 1)));
+            }
+        }
+        return stats;
+    }
+
     // Implemented in heapz.cc
     public static native void startSampling();
 
@@ -36,4 +72,36 @@ public class Heapz {
 
     public static native byte[] getResults();
 
+    /**
+     * With the leak_detection option, a profile of the sites whose in-use
+     * memory grew over the last garbage collections, most suspect first.
+     * Samples carry what is in use and labels the growth in bytes per second
+     * and how consistent it was. Empty until enough collections were seen.
+     */
+    public static native byte[] getLeakSuspects();
+
+    /**
+     * Changes sampling options while the agent runs, in agent option syntax,
+     * e.g. "interval_bytes=65536,max_samples_per_sec=500". Accepts
+     * interval_bytes, max_samples, max_samples_per_site, large_bytes,
+     * max_frames, max_samples_per_sec, max_overhead_permille and
+     * max_callback_p99_us; other options only apply at load time. Caps on
+     * retained samples apply from the next profile.
+     */
+    public static native void configure(String options);
+
+    /**
+     * Labels allocations of the current thread from now on, a null value
+     * removes the label. Labels end up as pprof sample labels.
+     */
+    public static native void setLabel(String key, String value);
+
+    public static native void clearLabels();
+
+    private static native String agentStats();
+
+    private static native void beginScope();
+
+    private static native byte[] endScope();
+
 }
@@ -0,0 +1,228 @@
+#ifndef AGENT_STATS_H_
+#define AGENT_STATS_H_
+
+// {{{ Includes
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "slot_registry.h"
+//  }}}
+
+/**
+ * HDR-style histogram of nanosecond durations.
+ *
+ * Buckets are log-linear: every power of two is split in kSubBuckets, so a
+ * bucket bound is within 1 / kSubBuckets of any value in it. Record is a
+ * relaxed increment meant for a single writer, Read may run concurrently.
+ */
+class HdrHistogram {
+public:
+  static constexpr int kSubBits = 3;
+  static constexpr uint64_t kSubBuckets = 1 << kSubBits;
+  // Durations are capped at 2^kMaxExponent nanoseconds, about 18 minutes
+  static constexpr int kMaxExponent = 40;
+  static constexpr size_t kBuckets = (kMaxExponent - kSubBits + 2) * kSubBuckets;
+
+  void Record(uint64_t nanos) {
+    Add(buckets_[BucketOf(nanos)], 1);
+    Add(count_, 1);
+    Add(nanos_, nanos);
+    if (nanos > max_.load(std::memory_order_relaxed))
+      max_.store(nanos, std::memory_order_relaxed);
+  }
+
+  struct Snapshot {
+    std::array<uint64_t, kBuckets> buckets{};
+    uint64_t count = 0;
+    uint64_t nanos = 0;
+    uint64_t max = 0;
+
+    void Merge(const Snapshot &other) {
+      for (size_t i = 0; i < kBuckets; i++) {
+        buckets[i] += other.buckets[i];
+      }
+      count += other.count;
+      nanos += other.nanos;
+      max = std::max(max, other.max);
+    }
+
+    // What was recorded after an earlier snapshot of the same histogram,
+    // max stays the overall one
+    Snapshot Since(const Snapshot &earlier) const {
+      Snapshot since = *this;
+      for (size_t i = 0; i < kBuckets; i++) {
+        since.buckets[i] -= earlier.buckets[i];
+      }
+      since.count -= earlier.count;
+      since.nanos -= earlier.nanos;
+      return since;
+    }
+
+    // Upper bound of the bucket holding the given quantile, 0 if empty
+    uint64_t Quantile(double quantile) const {
+      if (count == 0)
+        return 0;
+      auto rank = static_cast<uint64_t>(quantile * (count - 1));
+      uint64_t seen = 0;
+      for (size_t i = 0; i < kBuckets; i++) {
+        seen += buckets[i];
+        if (seen > rank)
+          return std::min(UpperBound(i), max);
+      }
+      return max;
+    }
+  };
+
+  Snapshot Read() const {
+    Snapshot snapshot;
+    for (size_t i = 0; i < kBuckets; i++) {
+      snapshot.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+    }
+    snapshot.count = count_.load(std::memory_order_relaxed);
+    snapshot.nanos = nanos_.load(std::memory_order_relaxed);
+    snapshot.max = max_.load(std::memory_order_relaxed);
+    return snapshot;
+  }
+
+  static size_t BucketOf(uint64_t nanos) {
+    nanos = std::min(nanos, (uint64_t(1) << (kMaxExponent + 1)) - 1);
+    if (nanos < kSubBuckets)
+      return nanos;
+    int exponent = 63 - __builtin_clzll(nanos);
+    auto sub = (nanos >> (exponent - kSubBits)) & (kSubBuckets - 1);
+    return (exponent - kSubBits + 1) * kSubBuckets + sub;
+  }
+  static uint64_t UpperBound(size_t bucket) {
+    if (bucket < kSubBuckets)
+      return bucket;
+    int exponent = bucket / kSubBuckets + kSubBits - 1;
+    auto sub = bucket % kSubBuckets;
+    auto width = uint64_t(1) << (exponent - kSubBits);
+    return (kSubBuckets + sub) * width + width - 1;
+  }
+
+private:
+  // Single writer, no need for an atomic read-modify-write
+  static void Add(std::atomic<uint64_t> &value, uint64_t delta) {
+    value.store(value.load(std::memory_order_relaxed) + delta,
+                std::memory_order_relaxed);
+  }
+
+  std::array<std::atomic<uint64_t>, kBuckets> buckets_{};
+  std::atomic<uint64_t> count_ = 0;
+  std::atomic<uint64_t> nanos_ = 0;
+  std::atomic<uint64_t> max_ = 0;
+};
+
+/**
+ * What the agent itself costs: durations of its operations and counts of
+ * notable events, since the agent was loaded.
+ *
+ * Every thread writes to a shard of its own, so recording takes no lock and
+ * no contended atomic; the shard of an exiting thread keeps its values. Read
+ * sums all shards and may run concurrently with writers.
+ */
+class AgentStats {
+public:
+  enum Timer {
+    kCallback,   // whole SampledObjectAlloc callback
+    kStackTrace, // GetStackTrace in the callback
+    kSymbolize,  // resolving a method not seen before
+    kLockWait,   // waiting for the session or storage lock
+    kForcedGc,   // export, forced garbage collection
+    kLiveness,   // export, checking which samples are still alive
+    kSerialize,  // export, encoding the profile
+    kTimers
+  };
+  enum Counter {
+    kSamples,          // callbacks that got past the filters
+    kSymbolMisses,     // methods symbolized in the callback
+    kFiltered,         // samples of classes filtered out
+    kStackTraceErrors, // samples dropped, their stack could not be walked
+    kThinned,          // samples dropped by retention caps
+    kCompacted,        // dead samples folded into per-site estimates
+    kCounters
+  };
+
+  class Shard : public SlotRegistry<Shard>::Entry {
+  public:
+    void Record(Timer timer, uint64_t nanos) { timers_[timer].Record(nanos); }
+    void Add(Counter counter, uint64_t delta = 1) {
+      auto &value = counters_[counter];
+      value.store(value.load(std::memory_order_relaxed) + delta,
+                  std::memory_order_relaxed);
+    }
+
+  private:
+    friend class AgentStats;
+    std::array<HdrHistogram, kTimers> timers_;
+    std::array<std::atomic<uint64_t>, kCounters> counters_{};
+  };
+
+  struct Snapshot {
+    std::array<HdrHistogram::Snapshot, kTimers> timers;
+    std::array<uint64_t, kCounters> counters{};
+
+    // Flat "name" / value pairs, durations in nanoseconds
+    std::vector<std::pair<std::string, uint64_t>> Values() const {
+      std::vector<std::pair<std::string, uint64_t>> values;
+      for (int i = 0; i < kTimers; i++) {
+        std::string name = TimerName(static_cast<Timer>(i));
+        auto const &timer = timers[i];
+        values.push_back({name + ".count", timer.count});
+        values.push_back({name + ".total_ns", timer.nanos});
+        values.push_back({name + ".p50_ns", timer.Quantile(0.5)});
+        values.push_back({name + ".p99_ns", timer.Quantile(0.99)});
+        values.push_back({name + ".max_ns", timer.max});
+      }
+      for (int i = 0; i < kCounters; i++) {
+        values.push_back({CounterName(static_cast<Counter>(i)), counters[i]});
+      }
+      return values;
+    }
+  };
+
+  AgentStats() = default;
+  AgentStats(const AgentStats &) = delete;
+  AgentStats &operator=(const AgentStats &) = delete;
+
+  Shard *Acquire() { return shards_.Acquire(); }
+  void Release(Shard *shard) { shards_.Release(shard); }
+
+  Snapshot Read() const {
+    Snapshot snapshot;
+    shards_.ForEach([&snapshot](Shard &shard) {
+      for (int i = 0; i < kTimers; i++) {
+        snapshot.timers[i].Merge(shard.timers_[i].Read());
+      }
+      for (int i = 0; i < kCounters; i++) {
+        snapshot.counters[i] +=
+            shard.counters_[i].load(std::memory_order_relaxed);
+      }
+    });
+    return snapshot;
+  }
+
+  static const char *TimerName(Timer timer) {
+    static const char *names[] = {"callback",  "stack_trace", "symbolize",
+                                  "lock_wait", "forced_gc",   "liveness",
+                                  "serialize"};
+    return names[timer];
+  }
+  static const char *CounterName(Counter counter) {
+    static const char *names[] = {"samples", "symbol_misses", "filtered",
+                                  "stack_trace_errors", "thinned",
+                                  "compacted"};
+    return names[counter];
+  }
+
+private:
+  SlotRegistry<Shard> shards_;
+};
+
+#endif // AGENT_STATS_H_
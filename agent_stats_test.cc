@@ -0,0 +1,99 @@
+#include "gtest/gtest.h"
+#include "agent_stats.h"
+
+#include <map>
+#include <thread>
+#include <vector>
+
+TEST(HdrHistogram, BucketBounds) {
+
+    for (uint64_t nanos : {0ULL, 7ULL, 8ULL, 1000ULL, 123456ULL, 1ULL << 40}) {
+        auto bucket = HdrHistogram::BucketOf(nanos);
+        auto upper = HdrHistogram::UpperBound(bucket);
+        EXPECT_GE(upper, nanos);
+        // within one sub-bucket of the value
+        EXPECT_LE(upper - nanos, nanos / HdrHistogram::kSubBuckets);
+    }
+    EXPECT_EQ(HdrHistogram::BucketOf(UINT64_MAX), HdrHistogram::kBuckets - 1);
+}
+
+TEST(HdrHistogram, Quantile) {
+
+    HdrHistogram underTest;
+    for (int i = 0; i < 99; i++) {
+        underTest.Record(1000);
+    }
+    underTest.Record(1000000);
+
+    auto snapshot = underTest.Read();
+    EXPECT_EQ(snapshot.count, 100);
+    EXPECT_EQ(snapshot.max, 1000000);
+    EXPECT_GE(snapshot.Quantile(0.5), 1000);
+    EXPECT_LT(snapshot.Quantile(0.5), 1000 + 1000 / HdrHistogram::kSubBuckets);
+    EXPECT_EQ(snapshot.Quantile(1), 1000000);
+    // reading does not reset
+    EXPECT_EQ(underTest.Read().count, 100);
+}
+
+TEST(HdrHistogram, Since) {
+
+    HdrHistogram underTest;
+    for (int i = 0; i < 100; i++) {
+        underTest.Record(1000);
+    }
+    auto earlier = underTest.Read();
+    for (int i = 0; i < 10; i++) {
+        underTest.Record(1000000);
+    }
+
+    auto since = underTest.Read().Since(earlier);
+    EXPECT_EQ(since.count, 10);
+    EXPECT_EQ(since.nanos, 10 * 1000000);
+    EXPECT_GE(since.Quantile(0.5), 1000000);
+    EXPECT_EQ(underTest.Read().Since(underTest.Read()).count, 0);
+}
+
+TEST(AgentStats, SumsShardsOfAllThreads) {
+
+    AgentStats underTest;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&underTest] {
+            auto shard = underTest.Acquire();
+            for (int i = 0; i < 1000; i++) {
+                shard->Record(AgentStats::kCallback, 100);
+                shard->Add(AgentStats::kSamples);
+            }
+            underTest.Release(shard);
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    auto snapshot = underTest.Read();
+    EXPECT_EQ(snapshot.timers[AgentStats::kCallback].count, 4000);
+    EXPECT_EQ(snapshot.timers[AgentStats::kCallback].nanos, 400000);
+    EXPECT_EQ(snapshot.counters[AgentStats::kSamples], 4000);
+
+    std::map<std::string, uint64_t> values;
+    for (auto const &[name, value] : snapshot.Values()) {
+        values[name] = value;
+    }
+    EXPECT_EQ(values["callback.count"], 4000);
+    EXPECT_EQ(values["callback.max_ns"], 100);
+    EXPECT_EQ(values["samples"], 4000);
+    EXPECT_EQ(values["thinned"], 0);
+}
+
+TEST(AgentStats, ReusesReleasedShards) {
+
+    AgentStats underTest;
+    auto shard = underTest.Acquire();
+    shard->Add(AgentStats::kThinned, 3);
+    underTest.Release(shard);
+
+    // values of an exited thread are kept
+    EXPECT_EQ(underTest.Acquire(), shard);
+    EXPECT_EQ(underTest.Read().counters[AgentStats::kThinned], 3);
+}
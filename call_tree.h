@@ -0,0 +1,181 @@
+#ifndef CALL_TREE_H_
+#define CALL_TREE_H_
+
+// {{{ Includes
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <jvmti.h>
+#include <vector>
+
+#include "stack_table.h"
+#include "upscaling.h"
+//  }}}
+
+/**
+ * Calling-context tree aggregating allocations as they are sampled.
+ *
+ * Stacks are inserted from the bottom frame, so stacks sharing callers share
+ * nodes and memory grows with the number of distinct call paths rather than
+ * with the number of samples. Children are kept in a lock-free list: a new
+ * node is published with a CAS on its parent's first child and is never
+ * unlinked, counters are plain atomics. Each sample is upscaled as it is
+ * added, since the weight of a sample is not linear in its size. Export
+ * reads and resets the sums, nodes are only freed with the tree.
+ */
+class CallTree {
+public:
+  CallTree() = default;
+  ~CallTree() { Free(root_.child.load()); }
+  CallTree(const CallTree &) = delete;
+  CallTree &operator=(const CallTree &) = delete;
+
+  /**
+   * Returns a non-zero id of the call path, stable for the tree's lifetime
+   *
+   * @param frames top of the stack first, as returned by GetStackTrace
+   */
+  template <typename F> uint64_t Intern(const F *frames, size_t depth) {
+    auto node = &root_;
+    for (size_t i = depth; i > 0; i--) {
+      node = Child(node, MethodOf(frames[i - 1]), frames[i - 1].location);
+    }
+    return reinterpret_cast<uint64_t>(node);
+  }
+
+  void AddAllocation(uint64_t path, long sizeBytes, long intervalBytes = 0) {
+    auto node = reinterpret_cast<Node *>(path);
+    // an interval of 0 samples every allocation, a weight of 1
+    Estimate sample;
+    sample.Add(sizeBytes, intervalBytes);
+    Accumulate(node->count, sample.Count());
+    Accumulate(node->bytes, sample.Bytes());
+    Accumulate(node->variance, sample.Variance());
+    // Last, a drain seeing the sample sees its sums too
+    node->samples.fetch_add(1, std::memory_order_release);
+  }
+
+  template <typename F>
+  void AddAllocation(const F *frames, size_t depth, long sizeBytes,
+                     long intervalBytes = 0) {
+    AddAllocation(Intern(frames, depth), sizeBytes, intervalBytes);
+  }
+
+  /**
+   * Visits every call path allocated from since the last drain and resets its
+   * counters
+   *
+   * @param consumer called with (samples, estimate, stack), the estimate
+   * upscaling every sample by its own size and interval and the stack
+   * ordered from the top frame like GetStackTrace
+   */
+  template <typename C> void Drain(C &&consumer) {
+    std::vector<Frame> path;
+    std::vector<Frame> stack;
+    Drain(root_.child.load(std::memory_order_acquire), path, stack, consumer);
+  }
+
+  // Visits the frame of every node, safe with concurrent interning
+  template <typename C> void ForEachFrame(C &&consumer) const {
+    ForEachFrame(root_.child.load(std::memory_order_acquire), consumer);
+  }
+
+  size_t size() const { return nodes_.load(std::memory_order_relaxed); }
+  size_t MemoryBytes() const { return size() * sizeof(Node); }
+
+private:
+  struct Node {
+    uintptr_t method = 0;
+    jlocation location = 0;
+    std::atomic<long> samples = 0;
+    // Estimate sums of the samples
+    std::atomic<double> count = 0;
+    std::atomic<double> bytes = 0;
+    std::atomic<double> variance = 0;
+    std::atomic<Node *> child = nullptr;
+    Node *sibling = nullptr; // immutable once published
+  };
+
+  static void Accumulate(std::atomic<double> &sum, double value) {
+    auto current = sum.load(std::memory_order_relaxed);
+    while (!sum.compare_exchange_weak(current, current + value,
+                                      std::memory_order_relaxed)) {
+    }
+  }
+
+  static Node *Find(Node *from, Node *to, uintptr_t method,
+                    jlocation location) {
+    for (auto node = from; node != to; node = node->sibling) {
+      if (node->method == method && node->location == location)
+        return node;
+    }
+    return nullptr;
+  }
+
+  Node *Child(Node *parent, uintptr_t method, jlocation location) {
+    auto head = parent->child.load(std::memory_order_acquire);
+    auto found = Find(head, nullptr, method, location);
+    if (found != nullptr)
+      return found;
+    auto node = new Node();
+    node->method = method;
+    node->location = location;
+    node->sibling = head;
+    while (!parent->child.compare_exchange_weak(node->sibling, node,
+                                                std::memory_order_release,
+                                                std::memory_order_acquire)) {
+      // Only nodes added since the last look can be new
+      found = Find(node->sibling, head, method, location);
+      if (found != nullptr) {
+        delete node;
+        return found;
+      }
+      head = node->sibling;
+    }
+    nodes_.fetch_add(1, std::memory_order_relaxed);
+    return node;
+  }
+
+  template <typename C>
+  static void Drain(Node *node, std::vector<Frame> &path,
+                    std::vector<Frame> &stack, C &consumer) {
+    for (; node != nullptr; node = node->sibling) {
+      path.push_back({node->method, node->location});
+      // Sums of a sample not counted yet stay for the next drain, a sample
+      // racing the drain may be split across two
+      auto samples = node->samples.exchange(0, std::memory_order_acquire);
+      if (samples > 0) {
+        const Estimate estimate(
+            node->count.exchange(0, std::memory_order_relaxed),
+            node->bytes.exchange(0, std::memory_order_relaxed),
+            node->variance.exchange(0, std::memory_order_relaxed));
+        stack.assign(path.rbegin(), path.rend());
+        consumer(samples, estimate, stack);
+      }
+      Drain(node->child.load(std::memory_order_acquire), path, stack,
+            consumer);
+      path.pop_back();
+    }
+  }
+
+  template <typename C> static void ForEachFrame(Node *node, C &consumer) {
+    for (; node != nullptr; node = node->sibling) {
+      consumer(Frame{node->method, node->location});
+      ForEachFrame(node->child.load(std::memory_order_acquire), consumer);
+    }
+  }
+
+  static void Free(Node *node) {
+    while (node != nullptr) {
+      Free(node->child.load());
+      auto sibling = node->sibling;
+      delete node;
+      node = sibling;
+    }
+  }
+
+  Node root_;
+  std::atomic<size_t> nodes_ = 0;
+};
+
+#endif // CALL_TREE_H_
@@ -0,0 +1,145 @@
+#include "gtest/gtest.h"
+#include "call_tree.h"
+
+#include <atomic>
+#include <map>
+#include <thread>
+#include <vector>
+
+// top frame first, like GetStackTrace
+static std::vector<Frame> stackOf(std::initializer_list<uintptr_t> methods) {
+    std::vector<Frame> frames;
+    for (auto method : methods) {
+        frames.push_back({method, 0});
+    }
+    return frames;
+}
+
+TEST(CallTree, SharesCallerPrefixes) {
+
+    CallTree underTest;
+    auto ab = stackOf({2, 1});
+    auto acb = stackOf({3, 2, 1});
+    auto ad = stackOf({4, 1});
+    underTest.AddAllocation(ab.data(), ab.size(), 16);
+    underTest.AddAllocation(ab.data(), ab.size(), 16);
+    underTest.AddAllocation(acb.data(), acb.size(), 32);
+    underTest.AddAllocation(ad.data(), ad.size(), 8);
+
+    // 1 -> {2 -> 3, 4}
+    EXPECT_EQ(underTest.size(), 4);
+
+    // an interval of 0 samples every allocation
+    std::map<uintptr_t, std::pair<double, double>> byTop;
+    underTest.Drain([&byTop](long, const Estimate &alloc,
+                             const std::vector<Frame> &stack) {
+        EXPECT_EQ(stack.back().method, 1);
+        byTop[stack.front().method] = {alloc.Count(), alloc.Bytes()};
+    });
+    EXPECT_EQ(byTop.size(), 3);
+    EXPECT_EQ(byTop[2], std::make_pair(2.0, 32.0));
+    EXPECT_EQ(byTop[3], std::make_pair(1.0, 32.0));
+    EXPECT_EQ(byTop[4], std::make_pair(1.0, 8.0));
+}
+
+TEST(CallTree, DrainResetsCounters) {
+
+    CallTree underTest;
+    auto stack = stackOf({2, 1});
+    underTest.AddAllocation(stack.data(), stack.size(), 16);
+
+    int samples = 0;
+    underTest.Drain([&samples](long, const Estimate &, const std::vector<Frame> &) { samples++; });
+    underTest.Drain([&samples](long, const Estimate &, const std::vector<Frame> &) { samples++; });
+    EXPECT_EQ(samples, 1);
+    EXPECT_EQ(underTest.size(), 2);
+}
+
+TEST(CallTree, ConcurrentAllocations) {
+
+    CallTree underTest;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&underTest] {
+            for (uintptr_t i = 0; i < 10000; i++) {
+                auto stack = stackOf({i % 50 + 10, i % 5 + 2, 1});
+                underTest.AddAllocation(stack.data(), stack.size(), 1);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    long total = 0;
+    underTest.Drain([&total](long samples, const Estimate &alloc, const std::vector<Frame> &) {
+        EXPECT_EQ(alloc.Count(), samples);
+        EXPECT_EQ(alloc.Bytes(), samples);
+        total += samples;
+    });
+    EXPECT_EQ(total, 40000);
+    // root child 1, 5 second level nodes, 50 distinct leaves
+    EXPECT_EQ(underTest.size(), 1 + 5 + 50);
+}
+
+TEST(CallTree, DrainsDuringAllocationsWithoutLosingBytes) {
+
+    CallTree underTest;
+    std::atomic_int finished = 0;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&underTest, &finished] {
+            auto stack = stackOf({3, 2, 1});
+            for (int i = 0; i < 100000; i++) {
+                underTest.AddAllocation(stack.data(), stack.size(), 16, 1);
+            }
+            finished++;
+        });
+    }
+
+    long samples = 0;
+    double count = 0, bytes = 0;
+    auto drain = [&] {
+        underTest.Drain([&](long s, const Estimate &alloc, const std::vector<Frame> &) {
+            samples += s;
+            count += alloc.Count();
+            bytes += alloc.Bytes();
+        });
+    };
+    // drains race the writers
+    while (finished < 4) {
+        drain();
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    drain();
+    EXPECT_EQ(samples, 400000);
+    auto weight = Estimate::Weight(16, 1);
+    EXPECT_NEAR(count, 400000 * weight, 1e-3);
+    EXPECT_NEAR(bytes, 400000 * weight * 16, 1e-2);
+}
+
+TEST(CallTree, UpscalesEachSampleBySize) {
+
+    CallTree underTest;
+    auto stack = stackOf({2, 1});
+    const long interval = 512 * 1024;
+    underTest.AddAllocation(stack.data(), stack.size(), 16, interval);
+    underTest.AddAllocation(stack.data(), stack.size(), 1024 * 1024, interval);
+
+    Estimate expected;
+    expected.Add(16, interval);
+    expected.Add(1024 * 1024, interval);
+    int paths = 0;
+    underTest.Drain([&](long samples, const Estimate &alloc, const std::vector<Frame> &) {
+        paths++;
+        EXPECT_EQ(samples, 2);
+        // the small sample stands for about 32768 allocations
+        EXPECT_NEAR(alloc.Count(), 32770, 1);
+        EXPECT_DOUBLE_EQ(alloc.Count(), expected.Count());
+        EXPECT_DOUBLE_EQ(alloc.Bytes(), expected.Bytes());
+        EXPECT_DOUBLE_EQ(alloc.BytesError(), expected.BytesError());
+    });
+    EXPECT_EQ(paths, 1);
+}
@@ -0,0 +1,78 @@
+#ifndef CLASS_FILTER_H_
+#define CLASS_FILTER_H_
+
+// {{{ Includes
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <vector>
+//  }}}
+
+/**
+ * Decides which allocated classes are sampled, by JVM class signature.
+ *
+ * Patterns are separated by '|' and are either a class, as a signature
+ * ("[B", "Ljava/lang/String;") or a Java name ("java.lang.String"), or a
+ * package prefix ending with '.' or ".*" ("java.util.", "com.acme.*"). A
+ * class is accepted if it matches an include pattern, or there are none,
+ * and matches no exclude pattern.
+ */
+class ClassFilter {
+public:
+  ClassFilter() = default;
+  ClassFilter(const std::string &include, const std::string &exclude)
+      : include_(Parse(include)), exclude_(Parse(exclude)) {}
+
+  bool Active() const { return !include_.empty() || !exclude_.empty(); }
+
+  bool Accepts(const std::string &signature) const {
+    return (include_.empty() || Matches(include_, signature)) &&
+           !Matches(exclude_, signature);
+  }
+
+private:
+  struct Pattern {
+    std::string signature; // whole signature, or prefix of one
+    bool prefix;
+  };
+
+  static std::vector<Pattern> Parse(const std::string &patterns) {
+    std::vector<Pattern> parsed;
+    std::istringstream iss(patterns);
+    std::string pattern;
+    while (std::getline(iss, pattern, '|')) {
+      if (!pattern.empty())
+        parsed.push_back(ToSignature(pattern));
+    }
+    return parsed;
+  }
+
+  static Pattern ToSignature(std::string pattern) {
+    if (pattern.size() >= 2 && pattern.compare(pattern.size() - 2, 2, ".*") == 0)
+      pattern.pop_back();
+    if (pattern.back() == '.') {
+      std::replace(pattern.begin(), pattern.end(), '.', '/');
+      return {"L" + pattern, true};
+    }
+    // Already a signature: an array or an L...; class type
+    if (pattern[0] == '[' || (pattern[0] == 'L' && pattern.back() == ';'))
+      return {pattern, false};
+    std::replace(pattern.begin(), pattern.end(), '.', '/');
+    return {"L" + pattern + ";", false};
+  }
+
+  static bool Matches(const std::vector<Pattern> &patterns,
+                      const std::string &signature) {
+    for (auto const &pattern : patterns) {
+      if (pattern.prefix ? signature.rfind(pattern.signature, 0) == 0
+                         : signature == pattern.signature)
+        return true;
+    }
+    return false;
+  }
+
+  std::vector<Pattern> include_;
+  std::vector<Pattern> exclude_;
+};
+
+#endif // CLASS_FILTER_H_
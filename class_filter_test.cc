@@ -0,0 +1,37 @@
+#include "gtest/gtest.h"
+#include "class_filter.h"
+
+TEST(ClassFilter, AcceptsEverythingByDefault) {
+
+    ClassFilter underTest;
+    EXPECT_FALSE(underTest.Active());
+    EXPECT_TRUE(underTest.Accepts("[B"));
+}
+
+TEST(ClassFilter, MatchesSignaturesAndJavaNames) {
+
+    ClassFilter underTest("[B|java.lang.String|Ljava/util/HashMap$Node;", "");
+    EXPECT_TRUE(underTest.Active());
+    EXPECT_TRUE(underTest.Accepts("[B"));
+    EXPECT_TRUE(underTest.Accepts("Ljava/lang/String;"));
+    EXPECT_TRUE(underTest.Accepts("Ljava/util/HashMap$Node;"));
+    EXPECT_FALSE(underTest.Accepts("[C"));
+    EXPECT_FALSE(underTest.Accepts("[[B"));
+    EXPECT_FALSE(underTest.Accepts("Ljava/lang/StringBuilder;"));
+}
+
+TEST(ClassFilter, MatchesPackages) {
+
+    ClassFilter underTest("java.util.|com.acme.*", "java.util.concurrent.");
+    EXPECT_TRUE(underTest.Accepts("Ljava/util/ArrayList;"));
+    EXPECT_TRUE(underTest.Accepts("Lcom/acme/Order;"));
+    EXPECT_FALSE(underTest.Accepts("Ljava/util/concurrent/ConcurrentHashMap;"));
+    EXPECT_FALSE(underTest.Accepts("Ljava/lang/Object;"));
+}
+
+TEST(ClassFilter, Excludes) {
+
+    ClassFilter underTest("", "[B|[C");
+    EXPECT_TRUE(underTest.Accepts("Ljava/lang/String;"));
+    EXPECT_FALSE(underTest.Accepts("[B"));
+}
@@ -0,0 +1,181 @@
+#ifndef CONCURRENT_MAP_H_
+#define CONCURRENT_MAP_H_
+
+// {{{ Includes
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+//  }}}
+
+/**
+ * Read-mostly concurrent map keyed by non-zero ids (method ids, class tags).
+ *
+ * Lookups are wait-free: a bounded linear probe over an open-addressing
+ * table with no stores. Inserts claim a slot with a CAS and never block each
+ * other; only the thread that grows the table takes a lock, other inserts
+ * yield while it copies and are replayed into the new table if they raced
+ * with it. Values and replaced tables are immutable once published and are
+ * only freed by Clear() or the destructor, which must not run concurrently
+ * with readers.
+ */
+template <typename V> class ConcurrentMap {
+public:
+  explicit ConcurrentMap(size_t capacity = 1024)
+      : table_(new Table(capacity)) {}
+  ~ConcurrentMap() { Free(); }
+  ConcurrentMap(const ConcurrentMap &) = delete;
+  ConcurrentMap &operator=(const ConcurrentMap &) = delete;
+
+  // Returns nullptr if id is not (yet) in the map
+  const V *Find(uintptr_t id) const {
+    auto table = table_.load(std::memory_order_acquire);
+    for (size_t i = 0, index = table->IndexOf(id); i <= table->mask;
+         i++, index = (index + 1) & table->mask) {
+      auto key = table->slots[index].key.load(std::memory_order_acquire);
+      if (key == id)
+        return table->slots[index].value.load(std::memory_order_acquire);
+      if (key == 0)
+        return nullptr;
+    }
+    return nullptr;
+  }
+
+  // Returns false if id is already present, the first value wins
+  bool Insert(uintptr_t id, V value) {
+    auto stored = new V(std::move(value));
+    bool published = false;
+    while (true) {
+      auto table = table_.load(std::memory_order_acquire);
+      if (table->frozen.load()) {
+        std::this_thread::yield(); // resize in progress
+        continue;
+      }
+      V *existing = nullptr;
+      auto result = table->Insert(id, stored, existing);
+      if (result == Table::kFull) {
+        Grow(table);
+        continue;
+      }
+      if (result == Table::kInserted) {
+        published = true;
+      } else if (existing != stored) {
+        if (!published)
+          delete stored;
+        return false;
+      }
+      // A table frozen before our slot got copied is replayed into its
+      // successor, where the copy is either found or inserted again.
+      if (table->frozen.load())
+        continue;
+      if (size_.fetch_add(1, std::memory_order_relaxed) + 1 >
+          (table->mask + 1) / 2) {
+        Grow(table);
+      }
+      return true;
+    }
+  }
+
+  size_t size() const { return size_.load(std::memory_order_relaxed); }
+
+  template <typename F> void ForEach(F &&consumer) const {
+    auto table = table_.load(std::memory_order_acquire);
+    for (size_t i = 0; i <= table->mask; i++) {
+      auto key = table->slots[i].key.load(std::memory_order_acquire);
+      auto value = table->slots[i].value.load(std::memory_order_acquire);
+      if (key != 0 && value != nullptr)
+        consumer(key, *value);
+    }
+  }
+
+  // Requires no concurrent readers or writers
+  void Clear() {
+    auto capacity = table_.load()->mask + 1;
+    Free();
+    table_.store(new Table(capacity));
+    size_.store(0);
+  }
+
+private:
+  struct Slot {
+    std::atomic<uintptr_t> key = 0;
+    std::atomic<V *> value = nullptr;
+  };
+
+  struct Table {
+    enum InsertResult { kInserted, kPresent, kFull };
+
+    explicit Table(size_t capacity)
+        : mask(capacity - 1), slots(new Slot[capacity]) {}
+
+    size_t IndexOf(uintptr_t id) const {
+      uint64_t hash = id * 0x9E3779B97F4A7C15ULL;
+      return (hash ^ (hash >> 32)) & mask;
+    }
+
+    InsertResult Insert(uintptr_t id, V *value, V *&existing) {
+      for (size_t i = 0, index = IndexOf(id); i <= mask;
+           i++, index = (index + 1) & mask) {
+        uintptr_t key = slots[index].key.load(std::memory_order_acquire);
+        if (key == 0 && slots[index].key.compare_exchange_strong(key, id)) {
+          slots[index].value.store(value);
+          return kInserted;
+        }
+        if (key == id) {
+          existing = slots[index].value.load();
+          return kPresent;
+        }
+      }
+      return kFull;
+    }
+
+    const size_t mask;
+    std::unique_ptr<Slot[]> slots;
+    std::atomic_bool frozen = false;
+    Table *retired = nullptr;
+  };
+
+  void Grow(Table *table) {
+    const std::lock_guard<std::mutex> lock(resize_);
+    if (table_.load() != table)
+      return; // already grown by another thread
+    table->frozen.store(true);
+    auto grown = new Table((table->mask + 1) * 2);
+    for (size_t i = 0; i <= table->mask; i++) {
+      auto key = table->slots[i].key.load();
+      auto value = table->slots[i].value.load();
+      V *existing;
+      if (key != 0 && value != nullptr)
+        grown->Insert(key, value, existing);
+    }
+    grown->retired = table;
+    table_.store(grown, std::memory_order_release);
+  }
+
+  // Values are shared between a table and the ones it replaced
+  void Free() {
+    std::unordered_set<V *> values;
+    auto table = table_.load();
+    while (table != nullptr) {
+      for (size_t i = 0; i <= table->mask; i++) {
+        values.insert(table->slots[i].value.load());
+      }
+      auto retired = table->retired;
+      delete table;
+      table = retired;
+    }
+    for (auto value : values) {
+      delete value;
+    }
+  }
+
+  std::atomic<Table *> table_;
+  std::atomic<size_t> size_ = 0;
+  std::mutex resize_;
+};
+
+#endif // CONCURRENT_MAP_H_
@@ -0,0 +1,78 @@
+// Method lookup contention benchmark: ConcurrentMap vs. the former
+// std::unordered_map behind a global mutex. Every lookup is a hit, as in a
+// warmed up agent.
+#include "concurrent_map.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+static const size_t kMethods = 4096;
+static const size_t kLookupsPerThread = 4000000;
+
+struct LockedMap {
+  std::mutex lock;
+  std::unordered_map<uintptr_t, std::string> methods;
+  bool Has(uintptr_t id) {
+    const std::lock_guard<std::mutex> guard(lock);
+    return methods.count(id) != 0;
+  }
+};
+
+struct LockFreeMap {
+  ConcurrentMap<std::string> methods;
+  bool Has(uintptr_t id) { return methods.Find(id) != nullptr; }
+};
+
+static uintptr_t methodId(size_t i) { return 0x7f0000001000 + i * 8; }
+
+template <typename Map> static double lookupsPerSecond(Map &map, int threads) {
+  std::vector<std::thread> workers;
+  auto start = std::chrono::steady_clock::now();
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([&map, t] {
+      size_t hits = 0;
+      uint64_t x = t + 1;
+      for (size_t i = 0; i < kLookupsPerThread; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        hits += map.Has(methodId(x % kMethods));
+      }
+      if (hits != kLookupsPerThread)
+        std::cerr << "unexpected miss" << std::endl;
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return threads * kLookupsPerThread / elapsed.count();
+}
+
+int main() {
+  LockedMap locked;
+  LockFreeMap lockFree;
+  for (size_t i = 0; i < kMethods; i++) {
+    locked.methods.insert({methodId(i), "method"});
+    lockFree.methods.Insert(methodId(i), "method");
+  }
+
+  int maxThreads = std::max(1u, std::thread::hardware_concurrency());
+  std::cout << std::setw(8) << "threads" << std::setw(20) << "mutex (Mops/s)"
+            << std::setw(20) << "concurrent (Mops/s)" << std::endl;
+  for (int threads = 1; threads <= maxThreads; threads *= 2) {
+    std::cout << std::setw(8) << threads << std::fixed << std::setprecision(1)
+              << std::setw(20) << lookupsPerSecond(locked, threads) / 1e6
+              << std::setw(20) << lookupsPerSecond(lockFree, threads) / 1e6
+              << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,68 @@
+#include "gtest/gtest.h"
+#include "concurrent_map.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+TEST(ConcurrentMap, FindAndInsert) {
+
+    ConcurrentMap<std::string> underTest;
+    EXPECT_EQ(underTest.Find(1), nullptr);
+    EXPECT_TRUE(underTest.Insert(1, "one"));
+    EXPECT_FALSE(underTest.Insert(1, "uno"));
+    EXPECT_EQ(*underTest.Find(1), "one");
+    EXPECT_EQ(underTest.size(), 1);
+}
+
+TEST(ConcurrentMap, GrowKeepsEntries) {
+
+    ConcurrentMap<long> underTest(4);
+    for (long i = 1; i <= 1000; i++) {
+        EXPECT_TRUE(underTest.Insert(i * 8, i));
+    }
+    EXPECT_EQ(underTest.size(), 1000);
+    for (long i = 1; i <= 1000; i++) {
+        ASSERT_NE(underTest.Find(i * 8), nullptr);
+        EXPECT_EQ(*underTest.Find(i * 8), i);
+    }
+    long sum = 0;
+    underTest.ForEach([&sum](uintptr_t, const long &value) { sum += value; });
+    EXPECT_EQ(sum, 1000 * 1001 / 2);
+}
+
+TEST(ConcurrentMap, ConcurrentInsertsWithReaders) {
+
+    ConcurrentMap<long> underTest(4);
+    const long perThread = 20000;
+    std::vector<std::thread> threads;
+    for (long t = 0; t < 4; t++) {
+        threads.emplace_back([&underTest, t] {
+            // overlapping ranges, every id is inserted by two threads
+            for (long i = 1; i <= perThread; i++) {
+                auto id = (t / 2) * perThread + i;
+                if (underTest.Insert(id, id)) {
+                    auto found = underTest.Find(id);
+                    ASSERT_NE(found, nullptr);
+                    EXPECT_EQ(*found, id);
+                }
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(underTest.size(), 2 * perThread);
+    for (long id = 1; id <= 2 * perThread; id++) {
+        ASSERT_NE(underTest.Find(id), nullptr);
+    }
+}
+
+TEST(ConcurrentMap, Clear) {
+
+    ConcurrentMap<long> underTest;
+    underTest.Insert(1, 1);
+    underTest.Clear();
+    EXPECT_EQ(underTest.size(), 0);
+    EXPECT_EQ(underTest.Find(1), nullptr);
+}
@@ -0,0 +1,75 @@
+#ifndef EPOCHS_H_
+#define EPOCHS_H_
+
+// {{{ Includes
+#include <atomic>
+#include <cstdint>
+
+#include "slot_registry.h"
+//  }}}
+
+/**
+ * Epoch based reclamation of data read without locks.
+ *
+ * A reader announces the epoch it starts in, in a slot of its own, and
+ * clears it when done. Data retired when the epoch was advanced past it can
+ * be freed once Quiescent tells that no reader is still announced in an
+ * epoch that could reach it. Announcing costs a store and a fence, no
+ * contended atomic.
+ */
+class Epochs {
+public:
+  class Slot : public SlotRegistry<Slot>::Entry {
+  private:
+    friend class Epochs;
+    std::atomic<uint64_t> epoch_ = 0; // 0 when not reading
+  };
+
+  Epochs() = default;
+  Epochs(const Epochs &) = delete;
+  Epochs &operator=(const Epochs &) = delete;
+
+  Slot *Acquire() { return slots_.Acquire(); }
+  void Release(Slot *slot) { slots_.Release(slot); }
+
+  // Announces the current epoch in the slot and returns it
+  uint64_t Enter(Slot &slot) {
+    auto epoch = current_.load(std::memory_order_acquire);
+    while (true) {
+      slot.epoch_.store(epoch, std::memory_order_relaxed);
+      // Pairs with Advance, either it sees the announcement or we see it
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      auto now = current_.load(std::memory_order_acquire);
+      if (now == epoch)
+        return epoch;
+      epoch = now;
+    }
+  }
+
+  void Exit(Slot &slot) { slot.epoch_.store(0, std::memory_order_release); }
+
+  uint64_t Current() const { return current_.load(std::memory_order_acquire); }
+
+  // Returns the new epoch
+  uint64_t Advance() {
+    return current_.fetch_add(1, std::memory_order_seq_cst) + 1;
+  }
+
+  // True if no reader is announced in an epoch before the given one
+  bool Quiescent(uint64_t epoch) const {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool quiescent = true;
+    slots_.ForEach([epoch, &quiescent](Slot &slot) {
+      auto announced = slot.epoch_.load(std::memory_order_acquire);
+      if (announced != 0 && announced < epoch)
+        quiescent = false;
+    });
+    return quiescent;
+  }
+
+private:
+  std::atomic<uint64_t> current_ = 1;
+  SlotRegistry<Slot> slots_;
+};
+
+#endif // EPOCHS_H_
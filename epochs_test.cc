@@ -0,0 +1,89 @@
+#include "gtest/gtest.h"
+#include "epochs.h"
+
+#include <thread>
+#include <vector>
+
+TEST(Epochs, QuiescentWithoutReaders) {
+
+    Epochs underTest;
+    EXPECT_EQ(underTest.Current(), 1);
+    EXPECT_TRUE(underTest.Quiescent(1));
+
+    EXPECT_EQ(underTest.Advance(), 2);
+    EXPECT_EQ(underTest.Current(), 2);
+    EXPECT_TRUE(underTest.Quiescent(100));
+}
+
+TEST(Epochs, WaitsForAnnouncedReader) {
+
+    Epochs underTest;
+    auto slot = underTest.Acquire();
+    EXPECT_EQ(underTest.Enter(*slot), 1);
+    underTest.Advance();
+    underTest.Advance();
+
+    // Only epochs before the announced one are known to be unused
+    EXPECT_TRUE(underTest.Quiescent(1));
+    EXPECT_FALSE(underTest.Quiescent(2));
+
+    underTest.Exit(*slot);
+    EXPECT_TRUE(underTest.Quiescent(3));
+
+    EXPECT_EQ(underTest.Enter(*slot), 3);
+    EXPECT_TRUE(underTest.Quiescent(3));
+    EXPECT_FALSE(underTest.Quiescent(4));
+    underTest.Exit(*slot);
+    underTest.Release(slot);
+}
+
+TEST(Epochs, ReusesReleasedSlots) {
+
+    Epochs underTest;
+    auto first = underTest.Acquire();
+    auto second = underTest.Acquire();
+    EXPECT_NE(first, second);
+
+    underTest.Release(first);
+    EXPECT_EQ(underTest.Acquire(), first);
+    underTest.Release(first);
+    underTest.Release(second);
+}
+
+TEST(Epochs, ReadersNeverSeeReclaimedEpochs) {
+
+    Epochs underTest;
+    // First epoch not freed yet
+    std::atomic<uint64_t> reclaimed = 0;
+    std::atomic_bool stopped = false;
+    std::atomic<long> violations = 0;
+
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; i++) {
+        readers.emplace_back([&underTest, &reclaimed, &stopped, &violations]() {
+            auto slot = underTest.Acquire();
+            while (!stopped.load()) {
+                auto epoch = underTest.Enter(*slot);
+                // Epochs before reclaimed were freed, the epoch of the
+                // reader and the one before it must not be
+                if (reclaimed.load() >= epoch)
+                    violations++;
+                underTest.Exit(*slot);
+            }
+            underTest.Release(slot);
+        });
+    }
+    for (int i = 0; i < 10000; i++) {
+        auto epoch = underTest.Advance();
+        // Epochs before epoch - 1 are freed once no reader is announced
+        // before epoch
+        while (!underTest.Quiescent(epoch))
+            std::this_thread::yield();
+        reclaimed.store(epoch - 1);
+    }
+    stopped = true;
+    for (auto &reader : readers) {
+        reader.join();
+    }
+    EXPECT_EQ(violations.load(), 0);
+}
@@ -2,6 +2,8 @@
 #include <algorithm>
 #include <array>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdlib>
 #include <functional>
 #include <iostream>
@@ -12,15 +14,23 @@
 #include <memory>
 #include <mutex>
 #include <ostream>
+#include <random>
 #include <sstream>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
+#include "agent_stats.h"
+#include "class_filter.h"
 #include "heapz-inl.h"
+#include "leak_detector.h"
 #include "log.h"
 #include "profile_exporter.h"
+#include "sample_buffer.h"
+#include "sampling_controller.h"
+#include "stack_memo.h"
 #include "storage.h"
+#include "thread_filter.h"
 //  }}}
 
 // {{{ Forward declarations
@@ -28,28 +38,263 @@ extern "C" {
 JNIEXPORT void JNICALL SampledObjectAlloc(jvmtiEnv *, JNIEnv *, jthread,
                                           jobject, jclass, jlong);
 JNIEXPORT void JNICALL VMStart(jvmtiEnv *, JNIEnv *);
+JNIEXPORT void JNICALL VMInit(jvmtiEnv *, JNIEnv *, jthread);
 JNIEXPORT void JNICALL VMDeath(jvmtiEnv *, JNIEnv *);
+JNIEXPORT void JNICALL ThreadStart(jvmtiEnv *, JNIEnv *, jthread);
+JNIEXPORT void JNICALL ObjectFree(jvmtiEnv *, jlong);
+JNIEXPORT void JNICALL GarbageCollectionFinish(jvmtiEnv *);
 }
 // }}}
 
+static const int kMaxFrames = 2048;
+
 struct HeapzOptions {
   std::string param_one_shot = "oneshot";
   std::string param_sampling_interval = "interval_bytes=";
   std::string param_max_samples = "max_samples=";
+  std::string param_deferred_symbols = "deferred_symbols";
+  std::string param_call_tree = "call_tree";
+  std::string param_max_frames = "max_frames=";
+  std::string param_site_frames = "site_frames=";
+  std::string param_max_samples_per_site = "max_samples_per_site=";
+  std::string param_large_bytes = "large_bytes=";
+  std::string param_include_classes = "include_classes=";
+  std::string param_exclude_classes = "exclude_classes=";
+  std::string param_include_threads = "include_threads=";
+  std::string param_exclude_threads = "exclude_threads=";
+  std::string param_max_samples_per_sec = "max_samples_per_sec=";
+  std::string param_max_overhead_permille = "max_overhead_permille=";
+  std::string param_max_callback_p99_us = "max_callback_p99_us=";
+  std::string param_tag_liveness = "tag_liveness";
+  std::string param_force_gc = "force_gc";
+  std::string param_leak_detection = "leak_detection";
   bool one_shot = false;
+  bool deferred_symbols = false;
+  bool call_tree = false;
   int sampling_interval = 1024;
+  // Deeper stacks are cut and end with a [truncated] frame
+  int max_frames = 256;
+  // Only the top frames are kept and aggregated per site, 0 disables
+  int site_frames = 0;
+  // Samples retained per window, then per stack, 0 is unlimited
   int max_samples = 1000000;
+  int max_samples_per_site = 0;
+  // Allocations retained regardless of max_samples, 0 disables
+  int large_bytes = 0;
+  // Classes or packages separated by '|', see ClassFilter
+  std::string include_classes;
+  std::string exclude_classes;
+  // Thread name or group:name prefixes separated by '|', see ThreadFilter
+  std::string include_threads;
+  std::string exclude_threads;
+  // Sampling budget held by retuning the interval, 0 is unlimited
+  int max_samples_per_sec = 0;
+  int max_overhead_permille = 0;
+  // Sampling is suspended when the callback p99 goes over it, 0 is unlimited
+  int max_callback_p99_us = 0;
+  // Sampled objects are tagged and tracked with ObjectFree events instead
+  // of weak global refs
+  bool tag_liveness = false;
+  // Export forces a full GC, else in-use values are as of the last GC
+  bool force_gc = false;
+  // In-use samples outlive their window to rank sites by growth at every
+  // GC, not with call_tree
+  bool leak_detection = false;
+};
+
+// What the sampling callback and the drainer read of HeapzOptions, published
+// as an immutable snapshot so that the runtime knobs can change under them
+struct SamplingOptions {
+  bool deferred_symbols;
+  bool call_tree;
+  bool tag_liveness;
+  int max_frames;
+  int site_frames;
+  int max_samples;
 };
 
 static std::mutex write;
 static std::atomic_bool isProfiling = false;
+// Guards turning the sampled allocation event on and off
+static std::mutex session;
+static bool samplingEnabled = false; // Requires session lock
+// Tuned under session lock, its options are immutable
+static std::unique_ptr<SamplingController> controller;
+static std::chrono::steady_clock::time_point lastTuned; // Requires session lock
+// Callback durations as of the last tick, the controller is fed what the
+// agent stats recorded since. Requires session lock.
+static HdrHistogram::Snapshot tunedCallbacks;
+static AgentStats agentStats;
+// Interval in effect, recorded with every sample
+static std::atomic_long samplingInterval = 0;
+// Class tags count down from -1, object tags are positive
+static std::atomic<jlong> nextClassTag = -1;
+static std::atomic<jlong> nextObjectTag = 1;
+// Garbage collections finished so far, and when the last one did
+static std::atomic_long gcEpoch = 0;
+static std::atomic_long lastGcNanos = 0;
+// Last collection the liveness pass looked at, requires write lock
+static long livenessEpoch = 0;
+static long livenessNanos = 0;
+// In-use samples of past windows and the sites they grow, leak_detection
+// only, require write lock
+struct Survivor {
+  long site;
+  AllocationInfo info;
+  double weight; // allocations it stands for
+};
+static std::vector<Survivor> survivors;
+static std::mt19937_64 survivorRandom(std::random_device{}());
+static std::bernoulli_distribution survivorCoin(0.5);
+static LeakDetector leaks;
+// Tags of sampled objects freed since the last drain, tag_liveness only
+static std::mutex freed_mutex;
+static std::vector<jlong> freedTags; // Requires freed lock
 static Storage storage;
+static SampleBuffers sampleBuffers;
 static ProfileExporter exporter(storage);
 
+// Keeps the declaring class of a method alive until it is symbolized
+struct MethodPin {
+  jmethodID method;
+  jobject klass;
+  MethodPin *next;
+};
+static std::atomic<MethodPin *> methodPins = nullptr;
+
+
+// Allocations of a thread inside Heapz.profile
+struct Scope {
+  CallTree calls;
+  StackMemo stacks;
+};
+
+// Per-thread agent state, released when the thread exits. Everything the
+// sampling callback needs is preallocated here so that, once methods and
+// stacks are known, a sample does not allocate.
+struct ThreadLocalState {
+  // Claimed on the first sample of a thread
+  SampleBuffer *buffer = nullptr;
+  // Sized on the first sample, one more than max_frames to tell when a stack
+  // was cut and one for the label frame
+  std::vector<jvmtiFrameInfo> frames;
+  // Set by Heapz.setLabel
+  Labels labels;
+  uint64_t labelSet = 0;
+  // Last stacks sampled by this thread, by stack or call path id
+  StackMemo stacks;
+  // Set inside Heapz.profile, the thread samples into it only
+  Scope *scope = nullptr;
+  // Direct-mapped memo of methods already pinned by this thread
+  std::array<jmethodID, 256> pinned{};
+  // Claimed on the first measurement of a thread
+  AgentStats::Shard *stats = nullptr;
+  // Claimed on the first use of storage generations without the storage lock
+  Epochs::Slot *epochSlot = nullptr;
+  // Storage epoch the memos and the label set were filled in
+  uint64_t epoch = 0;
+  ~ThreadLocalState() {
+    if (buffer != nullptr)
+      sampleBuffers.Release(buffer);
+    if (stats != nullptr)
+      agentStats.Release(stats);
+    if (epochSlot != nullptr)
+      storage.epochs.Release(epochSlot);
+  }
+};
+static thread_local ThreadLocalState threadState;
+
+// Keeps the storage generations of the current epoch from being freed while
+// the thread uses them without the storage lock
+class EpochGuard {
+public:
+  EpochGuard() {
+    if (threadState.epochSlot == nullptr)
+      threadState.epochSlot = storage.epochs.Acquire();
+    epoch_ = storage.epochs.Enter(*threadState.epochSlot);
+  }
+  ~EpochGuard() { storage.epochs.Exit(*threadState.epochSlot); }
+  EpochGuard(const EpochGuard &) = delete;
+  EpochGuard &operator=(const EpochGuard &) = delete;
+
+  uint64_t Epoch() const { return epoch_; }
+
+private:
+  uint64_t epoch_;
+};
+
+// Forgets what the thread remembered of generations rotated since its last
+// sample, its label set is interned again in the current one
+static void renewThreadState(uint64_t epoch) {
+  if (threadState.epoch == epoch)
+    return;
+  threadState.stacks.Clear();
+  if (threadState.scope != nullptr)
+    threadState.scope->stacks.Clear();
+  threadState.pinned.fill(nullptr);
+  if (threadState.labelSet != 0)
+    threadState.labelSet = storage.AddLabels(threadState.labels);
+  threadState.epoch = epoch;
+}
+
+static AgentStats::Shard &threadStats() {
+  if (threadState.stats == nullptr)
+    threadState.stats = agentStats.Acquire();
+  return *threadState.stats;
+}
+
+static long wallClockNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+static uint64_t nanosSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+// Lock guard recording how long contended acquisitions waited
+class TimedLock {
+public:
+  explicit TimedLock(std::mutex &mutex) : lock_(mutex, std::defer_lock) {
+    if (lock_.try_lock())
+      return;
+    auto start = std::chrono::steady_clock::now();
+    lock_.lock();
+    threadStats().Record(AgentStats::kLockWait, nanosSince(start));
+  }
+
+private:
+  std::unique_lock<std::mutex> lock_;
+};
+
 static std::function<bool(long)> setSamplingInterval;
 static std::function<void(void)> forceGarbageCollection;
 
+// Runtime knobs are changed by Heapz.configure, under session lock
 static HeapzOptions heapz_options;
+// Snapshot of heapz_options read by the sampling callback
+static std::atomic<const SamplingOptions *> sampling_options = nullptr;
+// Snapshots replaced by Heapz.configure with the storage epoch they were
+// replaced in, a callback announced before it may still be reading them.
+// Requires session lock.
+static std::vector<std::pair<const SamplingOptions *, uint64_t>>
+    retiredOptions;
+// Threads inside Heapz.profile, requires session lock
+static int activeScopes = 0;
+static JavaVM *heapz_jvm = NULL;
+static jvmtiEnv *heapz_jvmti = NULL;
+static ThreadFilter threadFilter;
+static ClassFilter classFilter;
+// Class filter decisions by class tag
+static ConcurrentMap<bool> classDecisions;
+
+static const auto kWorkerInterval = std::chrono::seconds(1);
+static std::mutex worker_mutex;
+static std::condition_variable worker_wakeup;
+static bool worker_stopped = false;
 
 static void storeAsInt(std::string src, int &dest) {
   int tmp;
@@ -60,8 +305,9 @@ static void storeAsInt(std::string src, int &dest) {
   }
 }
 
-static HeapzOptions parseOptions(char *options) {
-  HeapzOptions heapz_options;
+// Options missing from the string keep their value in heapz_options
+static HeapzOptions parseOptions(const char *options,
+                                 HeapzOptions heapz_options = HeapzOptions()) {
   std::string str(options ? options : "");
   std::istringstream iss(str);
   std::vector<std::string> opts;
@@ -73,22 +319,302 @@ static HeapzOptions parseOptions(char *options) {
   for (const auto &o : opts) {
     if (o == heapz_options.param_one_shot)
       heapz_options.one_shot = true;
+    if (o == heapz_options.param_deferred_symbols)
+      heapz_options.deferred_symbols = true;
+    if (o == heapz_options.param_call_tree)
+      heapz_options.call_tree = true;
+    if (o == heapz_options.param_tag_liveness)
+      heapz_options.tag_liveness = true;
+    if (o == heapz_options.param_force_gc)
+      heapz_options.force_gc = true;
+    if (o == heapz_options.param_leak_detection)
+      heapz_options.leak_detection = true;
     if (o.rfind(heapz_options.param_sampling_interval, 0) == 0) {
       auto value = o.substr(heapz_options.param_sampling_interval.size());
       storeAsInt(value, heapz_options.sampling_interval);
     }
+    if (o.rfind(heapz_options.param_max_frames, 0) == 0) {
+      auto value = o.substr(heapz_options.param_max_frames.size());
+      storeAsInt(value, heapz_options.max_frames);
+    }
+    if (o.rfind(heapz_options.param_site_frames, 0) == 0) {
+      auto value = o.substr(heapz_options.param_site_frames.size());
+      storeAsInt(value, heapz_options.site_frames);
+    }
     if (o.rfind(heapz_options.param_max_samples, 0) == 0) {
       auto value = o.substr(heapz_options.param_max_samples.size());
       storeAsInt(value, heapz_options.max_samples);
     }
+    if (o.rfind(heapz_options.param_max_samples_per_site, 0) == 0) {
+      auto value = o.substr(heapz_options.param_max_samples_per_site.size());
+      storeAsInt(value, heapz_options.max_samples_per_site);
+    }
+    if (o.rfind(heapz_options.param_large_bytes, 0) == 0) {
+      auto value = o.substr(heapz_options.param_large_bytes.size());
+      storeAsInt(value, heapz_options.large_bytes);
+    }
+    if (o.rfind(heapz_options.param_include_classes, 0) == 0)
+      heapz_options.include_classes =
+          o.substr(heapz_options.param_include_classes.size());
+    if (o.rfind(heapz_options.param_exclude_classes, 0) == 0)
+      heapz_options.exclude_classes =
+          o.substr(heapz_options.param_exclude_classes.size());
+    if (o.rfind(heapz_options.param_include_threads, 0) == 0)
+      heapz_options.include_threads =
+          o.substr(heapz_options.param_include_threads.size());
+    if (o.rfind(heapz_options.param_exclude_threads, 0) == 0)
+      heapz_options.exclude_threads =
+          o.substr(heapz_options.param_exclude_threads.size());
+    if (o.rfind(heapz_options.param_max_samples_per_sec, 0) == 0) {
+      auto value = o.substr(heapz_options.param_max_samples_per_sec.size());
+      storeAsInt(value, heapz_options.max_samples_per_sec);
+    }
+    if (o.rfind(heapz_options.param_max_overhead_permille, 0) == 0) {
+      auto value = o.substr(heapz_options.param_max_overhead_permille.size());
+      storeAsInt(value, heapz_options.max_overhead_permille);
+    }
+    if (o.rfind(heapz_options.param_max_callback_p99_us, 0) == 0) {
+      auto value = o.substr(heapz_options.param_max_callback_p99_us.size());
+      storeAsInt(value, heapz_options.max_callback_p99_us);
+    }
+  }
+  if (heapz_options.site_frames > 0) {
+    // Sites are call paths of a call tree cut at site_frames
+    heapz_options.call_tree = true;
+    heapz_options.max_frames = heapz_options.site_frames;
   }
+  heapz_options.max_frames =
+      std::clamp(heapz_options.max_frames, 1, kMaxFrames);
   LOG_INFO("Options: interval_bytes="
            << heapz_options.sampling_interval
            << " max_samples=" << heapz_options.max_samples
-           << " oneshot=" << heapz_options.one_shot << std::endl)
+           << " max_samples_per_site=" << heapz_options.max_samples_per_site
+           << " large_bytes=" << heapz_options.large_bytes
+           << " oneshot=" << heapz_options.one_shot
+           << " deferred_symbols=" << heapz_options.deferred_symbols
+           << " call_tree=" << heapz_options.call_tree
+           << " max_frames=" << heapz_options.max_frames
+           << " site_frames=" << heapz_options.site_frames
+           << " include_classes=" << heapz_options.include_classes
+           << " exclude_classes=" << heapz_options.exclude_classes
+           << " include_threads=" << heapz_options.include_threads
+           << " exclude_threads=" << heapz_options.exclude_threads
+           << " max_samples_per_sec=" << heapz_options.max_samples_per_sec
+           << " max_overhead_permille=" << heapz_options.max_overhead_permille
+           << " max_callback_p99_us=" << heapz_options.max_callback_p99_us
+           << " tag_liveness=" << heapz_options.tag_liveness
+           << " force_gc=" << heapz_options.force_gc
+           << " leak_detection=" << heapz_options.leak_detection
+           << std::endl)
   return heapz_options;
 }
 
+// {{{ Sampling session
+// The sampled allocation event is only enabled while sampling, an idle agent
+// costs the JVM nothing on allocation. With a thread filter it is enabled
+// per thread, excluded threads never take it.
+
+static std::string threadGroupName(jvmtiEnv *jvmti, JNIEnv *jni,
+                                   jthreadGroup group) {
+  std::string name;
+  jvmtiThreadGroupInfo info;
+  if (group == NULL ||
+      jvmti->GetThreadGroupInfo(group, &info) != JVMTI_ERROR_NONE)
+    return name;
+  if (info.name != NULL) {
+    name = info.name;
+    jvmti->Deallocate((unsigned char *)info.name);
+  }
+  jni->DeleteLocalRef(info.parent);
+  return name;
+}
+
+// Requires session lock. Only enables threads accepted by the filter.
+static jvmtiError setThreadSamplingEvent(jvmtiEnv *jvmti, JNIEnv *jni,
+                                         jthread thread, bool enabled) {
+  if (!enabled) {
+    // Threads inside Heapz.profile keep sampling
+    void *scope = nullptr;
+    jvmti->GetThreadLocalStorage(thread, &scope);
+    if (scope != nullptr)
+      return JVMTI_ERROR_NONE;
+  } else {
+    jvmtiThreadInfo info;
+    auto err = jvmti->GetThreadInfo(thread, &info);
+    if (err != JVMTI_ERROR_NONE)
+      return err;
+    std::string name = info.name != NULL ? info.name : "";
+    std::string group = threadFilter.NeedsGroup()
+                            ? threadGroupName(jvmti, jni, info.thread_group)
+                            : "";
+    jvmti->Deallocate((unsigned char *)info.name);
+    jni->DeleteLocalRef(info.thread_group);
+    jni->DeleteLocalRef(info.context_class_loader);
+    if (!threadFilter.Accepts(name, group))
+      return JVMTI_ERROR_NONE;
+    LOG_DEBUG("Sampling thread " << name << std::endl)
+  }
+  return jvmti->SetEventNotificationMode(enabled ? JVMTI_ENABLE
+                                                 : JVMTI_DISABLE,
+                                         JVMTI_EVENT_SAMPLED_OBJECT_ALLOC,
+                                         thread);
+}
+
+// Requires session lock
+static jvmtiError setAllThreadsSamplingEvent(bool enabled) {
+  jvmtiPhase phase;
+  auto err = heapz_jvmti->GetPhase(&phase);
+  // Before VMInit threads are enabled as they start
+  if (err != JVMTI_ERROR_NONE || phase != JVMTI_PHASE_LIVE)
+    return err;
+  JNIEnv *jni;
+  if (heapz_jvm->GetEnv((void **)&jni, JNI_VERSION_1_8) != JNI_OK)
+    return JVMTI_ERROR_UNATTACHED_THREAD;
+  jint count;
+  jthread *threads;
+  err = heapz_jvmti->GetAllThreads(&count, &threads);
+  if (err != JVMTI_ERROR_NONE)
+    return err;
+  for (jint i = 0; i < count; i++) {
+    auto result = setThreadSamplingEvent(heapz_jvmti, jni, threads[i], enabled);
+    // Threads may exit while they are walked
+    if (result != JVMTI_ERROR_NONE && result != JVMTI_ERROR_THREAD_NOT_ALIVE)
+      err = result;
+    jni->DeleteLocalRef(threads[i]);
+  }
+  heapz_jvmti->Deallocate((unsigned char *)threads);
+  return err;
+}
+
+// Requires session lock
+static bool setSamplingEvent(bool enabled) {
+  if (samplingEnabled == enabled)
+    return true;
+  auto result =
+      threadFilter.Active()
+          ? setAllThreadsSamplingEvent(enabled)
+          : heapz_jvmti->SetEventNotificationMode(
+                enabled ? JVMTI_ENABLE : JVMTI_DISABLE,
+                JVMTI_EVENT_SAMPLED_OBJECT_ALLOC, NULL);
+  if (result != JVMTI_ERROR_NONE) {
+    LOG_ERROR("Can't " << (enabled ? "enable" : "disable")
+                       << " sampled allocation events, JVMTI error code "
+                       << result << std::endl)
+    return false;
+  }
+  samplingEnabled = enabled;
+  return true;
+}
+
+// Requires session lock
+static bool startSession() {
+  controller->Reset();
+  tunedCallbacks = agentStats.Read().timers[AgentStats::kCallback];
+  lastTuned = std::chrono::steady_clock::now();
+  if (!setSamplingInterval(controller->Interval()))
+    return false;
+  isProfiling.store(true, std::memory_order_relaxed);
+  if (!setSamplingEvent(true)) {
+    isProfiling.store(false, std::memory_order_relaxed);
+    return false;
+  }
+  return true;
+}
+
+// Requires session lock
+static void stopSession() {
+  isProfiling.store(false, std::memory_order_relaxed);
+  setSamplingEvent(false);
+}
+
+// Requires session lock
+static void tuneSession() {
+  auto now = std::chrono::steady_clock::now();
+  auto elapsed =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(now - lastTuned);
+  lastTuned = now;
+  auto callbacks = agentStats.Read().timers[AgentStats::kCallback];
+  auto interval =
+      controller->Update(callbacks.Since(tunedCallbacks), elapsed.count());
+  tunedCallbacks = callbacks;
+  if (controller->Suspended()) {
+    LOG_ERROR("Sampling callback p99 over " << heapz_options.max_callback_p99_us
+                                            << "us, sampling suspended"
+                                            << std::endl)
+    stopSession();
+    return;
+  }
+  if (interval != samplingInterval.load(std::memory_order_relaxed))
+    setSamplingInterval(interval);
+}
+
+// Measures a sampling callback for the agent stats, the controller reads
+// them too
+class CallbackTimer {
+public:
+  explicit CallbackTimer(AgentStats::Shard &stats)
+      : stats_(stats), start_(std::chrono::steady_clock::now()) {}
+  ~CallbackTimer() { stats_.Record(AgentStats::kCallback, nanosSince(start_)); }
+
+private:
+  AgentStats::Shard &stats_;
+  const std::chrono::steady_clock::time_point start_;
+};
+// }}}
+
+// {{{ Options
+static SamplingController::Options controllerOptions(const HeapzOptions &o) {
+  return {.intervalBytes = o.sampling_interval,
+          .maxSamplesPerSec = o.max_samples_per_sec,
+          .maxOverheadPermille = o.max_overhead_permille,
+          .maxCallbackP99Micros = o.max_callback_p99_us};
+}
+
+// Requires session lock, or no sampling yet
+static void applyOptions() {
+  auto retired = sampling_options.exchange(
+      new SamplingOptions{
+          .deferred_symbols = heapz_options.deferred_symbols,
+          .call_tree = heapz_options.call_tree,
+          .tag_liveness = heapz_options.tag_liveness,
+          .max_frames = heapz_options.max_frames,
+          .site_frames = heapz_options.site_frames,
+          .max_samples = heapz_options.max_samples},
+      std::memory_order_acq_rel);
+  if (retired != nullptr)
+    retiredOptions.push_back({retired, storage.epochs.Advance()});
+  controller =
+      std::make_unique<SamplingController>(controllerOptions(heapz_options));
+  if (samplingEnabled) {
+    setSamplingInterval(controller->Interval());
+    tunedCallbacks = agentStats.Read().timers[AgentStats::kCallback];
+    lastTuned = std::chrono::steady_clock::now();
+  }
+  const TimedLock lock(write);
+  // Caps of a reservoir holding samples apply from the next window
+  storage.allocations.Configure(
+      {.maxSamples = static_cast<size_t>(std::max(heapz_options.max_samples, 0)),
+       .maxSamplesPerSite =
+           static_cast<size_t>(std::max(heapz_options.max_samples_per_site, 0)),
+       .largeBytes = heapz_options.large_bytes});
+  exporter.SetSamplingInterval(heapz_options.sampling_interval);
+}
+
+// Frees retired snapshots no callback can be reading anymore, requires
+// session lock
+static void reclaimOptions() {
+  size_t reclaimed = 0;
+  // Readers load the snapshot after announcing their epoch, those announced
+  // since a snapshot was replaced read a newer one
+  while (reclaimed < retiredOptions.size() &&
+         storage.epochs.Quiescent(retiredOptions[reclaimed].second)) {
+    delete retiredOptions[reclaimed++].first;
+  }
+  retiredOptions.erase(retiredOptions.begin(),
+                       retiredOptions.begin() + reclaimed);
+}
+// }}}
+
 // {{{ OnLoad Callback
 JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM *jvm, char *options,
                                     void *reserved) {
@@ -107,25 +633,31 @@ JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM *jvm, char *options,
   memset(&callbacks, 0, sizeof(callbacks));
   callbacks.SampledObjectAlloc = &SampledObjectAlloc;
   callbacks.VMStart = &VMStart;
+  callbacks.VMInit = &VMInit;
   callbacks.VMDeath = &VMDeath;
+  callbacks.ThreadStart = &ThreadStart;
+  callbacks.ObjectFree = &ObjectFree;
+  callbacks.GarbageCollectionFinish = &GarbageCollectionFinish;
 
   jvmtiCapabilities caps;
   memset(&caps, 0, sizeof(caps));
   caps.can_generate_sampled_object_alloc_events = 1;
   caps.can_get_line_numbers = 1;
   caps.can_get_source_file_name = 1;
+  caps.can_tag_objects = 1;
+  caps.can_generate_object_free_events = heapz_options.tag_liveness;
+  caps.can_generate_garbage_collection_events = 1;
   if (JVMTI_ERROR_NONE != jvmti->AddCapabilities(&caps)) {
     return JNI_ERR;
   }
 
-  if (JVMTI_ERROR_NONE !=
-      jvmti->SetEventNotificationMode(JVMTI_ENABLE,
-                                      JVMTI_EVENT_SAMPLED_OBJECT_ALLOC, NULL)) {
+  if (JVMTI_ERROR_NONE != jvmti->SetEventNotificationMode(
+                              JVMTI_ENABLE, JVMTI_EVENT_VM_START, NULL)) {
     return JNI_ERR;
   }
 
   if (JVMTI_ERROR_NONE != jvmti->SetEventNotificationMode(
-                              JVMTI_ENABLE, JVMTI_EVENT_VM_START, NULL)) {
+                              JVMTI_ENABLE, JVMTI_EVENT_VM_INIT, NULL)) {
     return JNI_ERR;
   }
 
@@ -134,6 +666,28 @@ JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM *jvm, char *options,
     return JNI_ERR;
   }
 
+  threadFilter = ThreadFilter(heapz_options.include_threads,
+                              heapz_options.exclude_threads);
+  classFilter = ClassFilter(heapz_options.include_classes,
+                            heapz_options.exclude_classes);
+  if (threadFilter.Active() &&
+      JVMTI_ERROR_NONE != jvmti->SetEventNotificationMode(
+                              JVMTI_ENABLE, JVMTI_EVENT_THREAD_START, NULL)) {
+    return JNI_ERR;
+  }
+
+  if (heapz_options.tag_liveness &&
+      JVMTI_ERROR_NONE != jvmti->SetEventNotificationMode(
+                              JVMTI_ENABLE, JVMTI_EVENT_OBJECT_FREE, NULL)) {
+    return JNI_ERR;
+  }
+
+  if (JVMTI_ERROR_NONE !=
+      jvmti->SetEventNotificationMode(
+          JVMTI_ENABLE, JVMTI_EVENT_GARBAGE_COLLECTION_FINISH, NULL)) {
+    return JNI_ERR;
+  }
+
   if (JVMTI_ERROR_NONE !=
       jvmti->SetEventCallbacks(&callbacks, sizeof(jvmtiEventCallbacks))) {
     return JNI_ERR;
@@ -146,10 +700,14 @@ JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM *jvm, char *options,
                 << std::endl;
       return false;
     }
+    samplingInterval.store(interval, std::memory_order_relaxed);
     LOG_INFO("Heap sampling interval set to " << interval << " bytes" << std::endl)
     return true;
   };
 
+  heapz_jvm = jvm;
+  heapz_jvmti = jvmti;
+
   forceGarbageCollection = [jvmti]() {
     auto result = jvmti->ForceGarbageCollection();
     if (result != JVMTI_ERROR_NONE) {
@@ -157,29 +715,456 @@ JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM *jvm, char *options,
     }
   };
 
-  setSamplingInterval(heapz_options.sampling_interval);
+  applyOptions();
 
   if (heapz_options.one_shot) {
-    isProfiling.store(true, std::memory_order_relaxed);
+    const TimedLock lock(session);
+    if (!startSession()) {
+      return JNI_ERR;
+    }
   }
 
-
   return JNI_OK;
 }
 // }}}
 
+// {{{ Symbolization
+// Classes are identified by a JVMTI tag so their signature and source file
+// are only looked up once, whichever method is symbolized first
+static jvmtiError resolveClass(jvmtiEnv *env, jclass klass, uintptr_t &id) {
+  jlong tag;
+  auto err = env->GetTag(klass, &tag);
+  if (err != JVMTI_ERROR_NONE)
+    return err;
+  if (tag != 0 && storage.HasClass(tag)) {
+    id = tag;
+    return JVMTI_ERROR_NONE;
+  }
+  if (tag == 0) {
+    tag = nextClassTag.fetch_sub(1, std::memory_order_relaxed);
+    err = env->SetTag(klass, tag);
+    if (err != JVMTI_ERROR_NONE)
+      return err;
+  }
+
+  char *classSignature;
+  err = env->GetClassSignature(klass, &classSignature, nullptr);
+  if (err != JVMTI_ERROR_NONE)
+    return err;
+  char *sourceFileName;
+  std::string sourceName = "Unknown";
+  if (env->GetSourceFileName(klass, &sourceFileName) == JVMTI_ERROR_NONE) {
+    sourceName = sourceFileName;
+    env->Deallocate((unsigned char *)sourceFileName);
+  }
+  storage.AddClass(tag, ClassInfo{.signature = classSignature,
+                                  .file = sourceName});
+  env->Deallocate((unsigned char *)classSignature);
+  id = tag;
+  return JVMTI_ERROR_NONE;
+}
+
+// Tags the allocated class like resolveClass so the filter decision is only
+// taken once per class. Samples are kept when the class can't be inspected.
+static bool acceptsClass(jvmtiEnv *env, jclass klass) {
+  jlong tag;
+  if (env->GetTag(klass, &tag) != JVMTI_ERROR_NONE)
+    return true;
+  if (tag != 0) {
+    auto decision = classDecisions.Find(tag);
+    if (decision != nullptr)
+      return *decision;
+  } else {
+    tag = nextClassTag.fetch_sub(1, std::memory_order_relaxed);
+    if (env->SetTag(klass, tag) != JVMTI_ERROR_NONE)
+      return true;
+  }
+  char *signature;
+  if (env->GetClassSignature(klass, &signature, nullptr) != JVMTI_ERROR_NONE)
+    return true;
+  bool accepted = classFilter.Accepts(signature);
+  LOG_DEBUG((accepted ? "Sampling class " : "Not sampling class ")
+            << signature << std::endl)
+  env->Deallocate((unsigned char *)signature);
+  classDecisions.Insert(tag, accepted);
+  return accepted;
+}
+
+static jvmtiError symbolize(jvmtiEnv *env, JNIEnv *jni, jmethodID method,
+                            MethodInfo &info) {
+  jint lineCount;
+  jvmtiLineNumberEntry *lineTable;
+  LineTable lines; // remains empty for native code
+  auto err = env->GetLineNumberTable(method, &lineCount, &lineTable);
+  if (err == JVMTI_ERROR_NONE) {
+    lines = LineTable(lineTable, lineCount);
+    env->Deallocate((unsigned char *)lineTable);
+  }
+
+  char *methodName;
+  char *methodSignature;
+  err = env->GetMethodName(method, &methodName, &methodSignature, nullptr);
+  if (err != JVMTI_ERROR_NONE)
+    return err;
+  jclass methodDeclaringClass;
+  err = env->GetMethodDeclaringClass(method, &methodDeclaringClass);
+  if (err == JVMTI_ERROR_NONE) {
+    uintptr_t classId;
+    err = resolveClass(env, methodDeclaringClass, classId);
+    if (err == JVMTI_ERROR_NONE) {
+      info = MethodInfo{.name = methodName,
+                        .klass = classId,
+                        .lines = std::move(lines)};
+    }
+    jni->DeleteLocalRef(methodDeclaringClass);
+  }
+
+  env->Deallocate((unsigned char *)methodName);
+  env->Deallocate((unsigned char *)methodSignature);
+  return err;
+}
+
+static void resolveMethod(jvmtiEnv *env, JNIEnv *jni, jmethodID method) {
+  auto methodId = reinterpret_cast<uintptr_t>(method);
+  if (storage.HasMethod(methodId))
+    return;
+  MethodInfo info{.name = "Unknown", .klass = 0};
+  auto err = symbolize(env, jni, method, info);
+  if (err != JVMTI_ERROR_NONE) {
+    LOG_DEBUG("Can't symbolize method " << method << ", JVMTI error code "
+                                        << err << std::endl)
+  }
+  storage.AddMethod(methodId, info);
+}
+
+// Called from the sampling thread, pins each method at most once per thread
+static void pinMethod(jvmtiEnv *env, JNIEnv *jni, jmethodID method) {
+  auto &pinned = threadState.pinned[(reinterpret_cast<uintptr_t>(method) >> 3) %
+                                    threadState.pinned.size()];
+  if (pinned == method)
+    return;
+  jclass klass;
+  if (env->GetMethodDeclaringClass(method, &klass) != JVMTI_ERROR_NONE)
+    return;
+  auto pin = new MethodPin{.method = method,
+                           .klass = jni->NewGlobalRef(klass),
+                           .next = methodPins.load(std::memory_order_relaxed)};
+  jni->DeleteLocalRef(klass);
+  while (!methodPins.compare_exchange_weak(pin->next, pin,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed)) {
+  }
+  pinned = method;
+}
+
+// Requires write lock, pinned methods are symbolized before their class is
+// released so a later lookup never touches an unloaded method. Every method
+// of a deferred sample was pinned by its thread, so this resolves them all.
+static void releaseMethodPins(jvmtiEnv *env, JNIEnv *jni, MethodPin *pin) {
+  while (pin != nullptr) {
+    resolveMethod(env, jni, pin->method);
+    jni->DeleteGlobalRef(pin->klass);
+    auto next = pin->next;
+    delete pin;
+    pin = next;
+  }
+}
+// }}}
+
+// Requires write lock
+static void drainSampleBuffers(jvmtiEnv *env, JNIEnv *jni) {
+  auto pins = methodPins.exchange(nullptr, std::memory_order_acquire);
+  auto tags = heapz_options.tag_liveness;
+  // Taken first: a sample freed before this point was pushed before it too
+  std::vector<jlong> freed;
+  if (tags) {
+    const std::lock_guard<std::mutex> lock(freed_mutex);
+    freed.swap(freedTags);
+  }
+  [[maybe_unused]] auto drained =
+      sampleBuffers.Drain([jni, tags](Sample &&sample) {
+        if (tags)
+          storage.liveObjects.insert(sample.info.ref);
+        storage.AddAllocation(sample.stackId, sample.info,
+                              [jni, tags](const AllocationInfo &thinned) {
+                                threadStats().Add(AgentStats::kThinned);
+                                if (tags) {
+                                  storage.liveObjects.erase(thinned.ref);
+                                } else {
+                                  jni->DeleteWeakGlobalRef(
+                                      reinterpret_cast<jweak>(thinned.ref));
+                                }
+                              });
+      });
+  for (auto tag : freed) {
+    storage.liveObjects.erase(tag);
+  }
+  releaseMethodPins(env, jni, pins);
+  LOG_DEBUG("Drained " << drained << " samples, " << freed.size()
+                       << " freed" << std::endl)
+}
+
+// Requires write lock
+static void releaseSurvivor(JNIEnv *jni, const Survivor &survivor) {
+  if (heapz_options.tag_liveness) {
+    storage.liveObjects.erase(survivor.info.ref);
+  } else {
+    jni->DeleteWeakGlobalRef(reinterpret_cast<jweak>(survivor.info.ref));
+  }
+}
+
+// Adds in-use bytes and objects by site to the leak detector, requires
+// write lock
+static void snapshotLeaks(JNIEnv *jni) {
+  std::unordered_map<long, std::pair<double, double>> inUse;
+  auto add = [&inUse](long site, const AllocationInfo &info, double weight) {
+    auto &values = inUse[site];
+    values.first += weight * info.sizeBytes;
+    values.second += weight;
+  };
+  storage.allocations.ForEach(
+      [&add](long site, const AllocationInfo &info, double retained) {
+        if (info.survivedEpoch == livenessEpoch)
+          add(site, info,
+              Estimate::Weight(info.sizeBytes, info.intervalBytes) * retained);
+      });
+  size_t kept = 0;
+  for (auto &survivor : survivors) {
+    auto alive = heapz_options.tag_liveness
+                     ? storage.liveObjects.count(survivor.info.ref) > 0
+                     : !jni->IsSameObject(
+                           reinterpret_cast<jweak>(survivor.info.ref), NULL);
+    if (alive) {
+      add(survivor.site, survivor.info, survivor.weight);
+      survivors[kept++] = survivor;
+    } else {
+      releaseSurvivor(jni, survivor);
+    }
+  }
+  survivors.resize(kept);
+  leaks.Snapshot(livenessNanos, inUse);
+}
+
+// Folds samples seen dead into per-site estimates, only live ones stay
+// stored, requires write lock
+static void compactDeadSamples(JNIEnv *jni) {
+  auto tags = heapz_options.tag_liveness;
+  auto compacted = storage.allocations.Compact(
+      [](const AllocationInfo &info) { return info.deathNanos > 0; },
+      [jni, tags](long site, const AllocationInfo &info, double retained) {
+        storage.folded[site].Add(info, retained, false, 0);
+        // A freed tag is gone already
+        if (!tags)
+          jni->DeleteWeakGlobalRef(reinterpret_cast<jweak>(info.ref));
+      });
+  threadStats().Add(AgentStats::kCompacted, compacted);
+  LOG_DEBUG("Compacted " << compacted << " dead samples" << std::endl)
+}
+
+// Marks which samples survived the last garbage collection and compacts the
+// dead ones, requires write lock
+static void updateLiveness(JNIEnv *jni) {
+  auto epoch = gcEpoch.load(std::memory_order_acquire);
+  if (epoch == livenessEpoch)
+    return;
+  auto start = std::chrono::steady_clock::now();
+  auto tags = heapz_options.tag_liveness;
+  auto gcNanos = lastGcNanos.load(std::memory_order_relaxed);
+  storage.allocations.Update([jni, tags, epoch, gcNanos](long,
+                                                         AllocationInfo &info) {
+    // Younger samples did not go through it, dead ones stay dead
+    if (info.gcEpoch >= epoch || info.deathNanos > 0)
+      return;
+    auto alive = tags ? storage.liveObjects.count(info.ref) > 0
+                      : !jni->IsSameObject(reinterpret_cast<jweak>(info.ref),
+                                           NULL);
+    if (alive) {
+      info.survivedEpoch = epoch;
+    } else {
+      info.deathNanos = gcNanos;
+    }
+  });
+  livenessEpoch = epoch;
+  livenessNanos = gcNanos;
+  if (heapz_options.leak_detection)
+    snapshotLeaks(jni);
+  compactDeadSamples(jni);
+  threadStats().Record(AgentStats::kLiveness, nanosSince(start));
+}
+
+// Keeps in-use samples of the window ending now, requires write lock
+static void keepSurvivors(JNIEnv *jni) {
+  if (livenessEpoch == 0)
+    return;
+  storage.allocations.ForEach(
+      [](long site, const AllocationInfo &info, double retained) {
+        if (info.survivedEpoch == livenessEpoch)
+          survivors.push_back(
+              {site, info,
+               Estimate::Weight(info.sizeBytes, info.intervalBytes) *
+                   retained});
+      });
+  // Over the cap each survivor goes on a coin flip, the rest stand for
+  // twice as many, so every site keeps an unbiased estimate
+  size_t cap;
+  {
+    const EpochGuard guard;
+    cap = std::max(sampling_options.load(std::memory_order_acquire)->max_samples,
+                   0);
+  }
+  while (cap > 0 && survivors.size() > cap) {
+    size_t kept = 0;
+    for (auto &survivor : survivors) {
+      if (survivorCoin(survivorRandom)) {
+        survivors[kept] = survivor;
+        survivors[kept++].weight *= 2;
+      } else {
+        releaseSurvivor(jni, survivor);
+      }
+    }
+    survivors.resize(kept);
+  }
+}
+
+// Requires write lock, starts a storage generation keeping the stacks
+// survivors and leak suspects refer to
+static void rotateStorage() {
+  auto keep = leaks.Sites();
+  for (auto const &survivor : survivors) {
+    keep.push_back(survivor.site);
+  }
+  storage.Rotate(keep);
+}
+
+// {{{ Agent worker thread
+static void JNICALL WorkerThread(jvmtiEnv *jvmti, JNIEnv *jni, void *arg) {
+  LOG_INFO("Started heapz worker thread" << std::endl)
+  std::unique_lock<std::mutex> worker_lock(worker_mutex);
+  while (!worker_stopped) {
+    worker_wakeup.wait_for(worker_lock, kWorkerInterval);
+    bool scoped;
+    {
+      const TimedLock lock(session);
+      if (samplingEnabled && controller->Enabled())
+        tuneSession();
+      reclaimOptions();
+      scoped = activeScopes > 0;
+    }
+    const TimedLock lock(write);
+    drainSampleBuffers(jvmti, jni);
+    // Even with force_gc, dead samples are not held until the export
+    updateLiveness(jni);
+    // Paths of a scope may refer to methods of any generation
+    if (!scoped)
+      storage.Reclaim();
+  }
+}
+
+static void startWorkerThread(jvmtiEnv *jvmti, JNIEnv *env) {
+  jclass threadClass = env->FindClass("java/lang/Thread");
+  jmethodID init =
+      env->GetMethodID(threadClass, "<init>", "(Ljava/lang/String;)V");
+  jobject thread =
+      env->NewObject(threadClass, init, env->NewStringUTF("heapz-worker"));
+  if (thread == NULL ||
+      JVMTI_ERROR_NONE != jvmti->RunAgentThread(thread, &WorkerThread, NULL,
+                                                JVMTI_THREAD_NORM_PRIORITY)) {
+    LOG_ERROR("Can't start heapz worker thread" << std::endl)
+  }
+}
+
+static void stopWorkerThread() {
+  const std::lock_guard<std::mutex> worker_lock(worker_mutex);
+  worker_stopped = true;
+  worker_wakeup.notify_all();
+}
+// }}}
+
+// {{{ Agent stats
+// Requires write lock
+static std::vector<std::pair<std::string, uint64_t>> agentStatValues() {
+  auto values = agentStats.Read().Values();
+  values.push_back(
+      {"memory_bytes", storage.MemoryBytes() + sampleBuffers.MemoryBytes() +
+                           survivors.size() * sizeof(Survivor)});
+  if (heapz_options.tag_liveness)
+    values.push_back({"live_samples", storage.liveObjects.size()});
+  return values;
+}
+
+// Requires write lock
+static std::vector<std::string> agentStatComments() {
+  std::vector<std::string> comments;
+  for (auto const &[name, value] : agentStatValues()) {
+    comments.push_back("heapz: " + name + "=" + std::to_string(value));
+  }
+  return comments;
+}
+
+// Requires write lock
+static void recordExport() {
+  auto &stats = threadStats();
+  auto &phases = exporter.LastExport();
+  // Nothing was sampled, nothing was exported
+  if (phases.serializeNanos == 0)
+    return;
+  stats.Record(AgentStats::kLiveness, phases.livenessNanos);
+  stats.Record(AgentStats::kSerialize, phases.serializeNanos);
+}
+// }}}
+
 std::vector<unsigned char> exportHeapProfile(JNIEnv *env) {
   LOG_DEBUG("Starting heap sample export" << std::endl)
-  LOG_DEBUG("Forcing GC" << std::endl)
-  forceGarbageCollection();
-  LOG_DEBUG("Forcing GC completed" << std::endl)
-  const std::lock_guard<std::mutex> lock(write);
-  auto &&buffer = exporter.ExportHeapProfile([env](uintptr_t ref) {
-    auto jref = reinterpret_cast<jweak>(ref);
-    auto isInUse = !env->IsSameObject(jref, NULL);
-    env->DeleteWeakGlobalRef(jref);
-    return isInUse;
-  });
+  if (heapz_options.call_tree) {
+    const TimedLock lock(write);
+    releaseMethodPins(heapz_jvmti, env,
+                      methodPins.exchange(nullptr, std::memory_order_acquire));
+    auto &&buffer = exporter.ExportCallTree(agentStatComments());
+    recordExport();
+    LOG_DEBUG("Call tree export completed, " << storage.CallPaths()
+                                             << " call paths" << std::endl)
+    storage.Rotate();
+    return buffer;
+  }
+  auto tags = heapz_options.tag_liveness;
+  if (heapz_options.force_gc) {
+    LOG_DEBUG("Forcing GC" << std::endl)
+    auto start = std::chrono::steady_clock::now();
+    forceGarbageCollection();
+    threadStats().Record(AgentStats::kForcedGc, nanosSince(start));
+    LOG_DEBUG("Forcing GC completed" << std::endl)
+  }
+  const TimedLock lock(write);
+  drainSampleBuffers(heapz_jvmti, env);
+  // A forced collection is the last one too
+  updateLiveness(env);
+  auto comments = agentStatComments();
+  comments.push_back(livenessEpoch == 0
+                         ? "heapz: no GC yet, nothing is known to be in use"
+                         : "heapz: in use as of GC " +
+                               std::to_string(livenessEpoch));
+  auto keep = heapz_options.leak_detection;
+  if (keep)
+    keepSurvivors(env);
+  auto &&buffer = exporter.ExportHeapProfile(
+      [env, tags, keep](const AllocationInfo &info) {
+        auto isInUse =
+            livenessEpoch > 0 && info.survivedEpoch == livenessEpoch;
+        // Survivors keep their refs
+        if (!tags && !(keep && isInUse))
+          env->DeleteWeakGlobalRef(reinterpret_cast<jweak>(info.ref));
+        return isInUse;
+      },
+      comments, livenessNanos);
+  // Objects of the next window are tracked from scratch, their tags stay
+  storage.liveObjects.clear();
+  if (tags) {
+    for (auto const &survivor : survivors) {
+      storage.liveObjects.insert(survivor.info.ref);
+    }
+  }
+  recordExport();
+  rotateStorage();
   LOG_DEBUG("Heap sample export completed" << std::endl)
   return buffer;
 }
@@ -188,13 +1173,6 @@ JNIEXPORT void JNICALL Agent_OnUnload(JavaVM *vm) {
   LOG_INFO("Unloading heapz agent" << std::endl)
 }
 
-void check(jvmtiError err, const char *msg) {
-  if (err != JVMTI_ERROR_NONE) {
-    std::cout << msg << std::endl;
-    exit(err);
-  }
-}
-
 JNIEXPORT void JNICALL VMStart(jvmtiEnv *jvmti, JNIEnv *env) {
 
   jclass klass = env->DefineClass("Heapz", NULL, (jbyte const *)Heapz_class,
@@ -205,7 +1183,51 @@ JNIEXPORT void JNICALL VMStart(jvmtiEnv *jvmti, JNIEnv *env) {
   }
 }
 
+JNIEXPORT void JNICALL VMInit(jvmtiEnv *jvmti, JNIEnv *env, jthread thread) {
+  if (threadFilter.Active()) {
+    // A oneshot session started before threads could be enabled
+    const TimedLock lock(session);
+    auto err = samplingEnabled ? setAllThreadsSamplingEvent(true)
+                               : JVMTI_ERROR_NONE;
+    if (err != JVMTI_ERROR_NONE) {
+      LOG_ERROR("Can't enable sampled allocation events, JVMTI error code "
+                << err << std::endl)
+    }
+  }
+  startWorkerThread(jvmti, env);
+}
+
+// Only enabled with a thread filter. Threads renamed after they started
+// keep the decision made for their initial name.
+JNIEXPORT void JNICALL ThreadStart(jvmtiEnv *jvmti, JNIEnv *jni,
+                                   jthread thread) {
+  const TimedLock lock(session);
+  if (samplingEnabled)
+    setThreadSamplingEvent(jvmti, jni, thread, true);
+}
+
+// Runs in the GC, only notes when it finished for the liveness pass
+JNIEXPORT void JNICALL GarbageCollectionFinish(jvmtiEnv *jvmti) {
+  lastGcNanos.store(wallClockNanos(), std::memory_order_relaxed);
+  gcEpoch.fetch_add(1, std::memory_order_release);
+}
+
+// Runs outside of a safepoint but may not call JNI, the drainer applies it
+JNIEXPORT void JNICALL ObjectFree(jvmtiEnv *jvmti, jlong tag) {
+  // Class tags are negative
+  if (tag <= 0)
+    return;
+  const std::lock_guard<std::mutex> lock(freed_mutex);
+  freedTags.push_back(tag);
+}
+
 JNIEXPORT void JNICALL VMDeath(jvmtiEnv *jvmti, JNIEnv *env) {
+  stopWorkerThread();
+  {
+    // Snapshots a callback still reads go with the process
+    const TimedLock lock(session);
+    reclaimOptions();
+  }
   if (heapz_options.one_shot) {
     LOG_INFO("OneShot profile export on VMDeath" << std::endl)
     auto profile = exportHeapProfile(env);
@@ -221,114 +1243,120 @@ extern "C" JNIEXPORT void JNICALL SampledObjectAlloc(jvmtiEnv *env, JNIEnv *jni,
                                                      jobject object,
                                                      jclass klass, jlong size) {
 
-  if (!isProfiling.load(std::memory_order_relaxed))
+  auto scope = threadState.scope;
+  if (scope == nullptr && !isProfiling.load(std::memory_order_relaxed))
     return;
-
-  if (storage.allocations.size() >= heapz_options.max_samples) {
-    isProfiling.store(false, std::memory_order_relaxed);
-    LOG_DEBUG("Max samples (" << heapz_options.max_samples
-                              << ") exceeded, sampling stopped" << std::endl)
+  // Keeps the options snapshot and storage generations from being freed
+  const EpochGuard guard;
+  auto &options = *sampling_options.load(std::memory_order_acquire);
+  auto &stats = threadStats();
+  CallbackTimer timer(stats);
+  if (classFilter.Active() && !acceptsClass(env, klass)) {
+    stats.Add(AgentStats::kFiltered);
     return;
   }
+  stats.Add(AgentStats::kSamples);
+  renewThreadState(guard.Epoch());
 
-  const int max_frames = 256;
-  jvmtiFrameInfo frames[max_frames];
+  auto max_frames = options.max_frames;
+  if (threadState.frames.size() < static_cast<size_t>(max_frames) + 2)
+    threadState.frames.resize(max_frames + 2);
+  auto frames = threadState.frames.data();
   jint frame_count;
   jvmtiError err;
 
-  err = env->GetStackTrace(NULL, 0, max_frames, frames, &frame_count);
-  if (err == JVMTI_ERROR_NONE && frame_count >= 1) {
-
-    jmethodID top = frames[0].method;
-    StackTrace stack;
-    long hash = 0;
+  auto site_only = options.site_frames > 0;
+  auto walk = std::chrono::steady_clock::now();
+  err = env->GetStackTrace(NULL, 0, site_only ? max_frames : max_frames + 1,
+                           frames, &frame_count);
+  stats.Record(AgentStats::kStackTrace, nanosSince(walk));
+  if (err != JVMTI_ERROR_NONE || frame_count < 1) {
+    stats.Add(AgentStats::kStackTraceErrors);
+  } else {
+    // Java frames, a cut stack ends with one more marking it
+    auto depth = std::min(frame_count, max_frames);
+    if (frame_count > max_frames) {
+      frames[max_frames] = {reinterpret_cast<jmethodID>(kTruncatedMethod), 0};
+    }
+    if (threadState.labelSet != 0) {
+      frames[frame_count++] = {reinterpret_cast<jmethodID>(kLabelsMethod),
+                               static_cast<jlocation>(threadState.labelSet)};
+    }
 
-    for (auto i = 0; i < frame_count; i++) {
+    auto &stacks = scope != nullptr ? scope->stacks : threadState.stacks;
+    uint64_t stackId = stacks.Find(frames, frame_count);
+    // Methods of a remembered stack were already symbolized or pinned
+    for (auto i = 0; stackId == 0 && i < depth; i++) {
       jmethodID method = frames[i].method;
-      jlocation location = frames[i].location;
       uintptr_t methodId = reinterpret_cast<uintptr_t>(method);
 
-      // from heapster / gperftools
-      hash += reinterpret_cast<uintptr_t>(method);
-      hash += hash << 10;
-      hash ^= hash >> 6;
-
-      stack.AddFrame(methodId);
-
-      {
-        const std::lock_guard<std::mutex> lock(write);
-        if (storage.HasMethod(methodId))
-          continue;
-      }
-
-      jint lineCount;
-      jvmtiLineNumberEntry *lineTable;
-      int lineNumber = 0; // remains zero for native code
-      err = env->GetLineNumberTable(method, &lineCount, &lineTable);
-      if (err == JVMTI_ERROR_NONE) {
-        lineNumber = lineTable[0].line_number;
-        for (int i = 1; i < lineCount; i++) {
-          if (location < lineTable[i].start_location) {
-            break;
-          }
-          lineNumber = lineTable[i].line_number;
-        }
-        env->Deallocate((unsigned char *)lineTable);
-      }
+      // Resolved methods need no pin, the pin memo misses on collisions
+      if (storage.HasMethod(methodId))
+        continue;
 
-      char *methodName;
-      char *methodSignature;
-      err = env->GetMethodName(method, &methodName, &methodSignature, nullptr);
-      check(err, "meth name");
-      jclass methodDeclaringClass;
-      err = env->GetMethodDeclaringClass(method, &methodDeclaringClass);
-      check(err, "decl class");
-      char *methodDeclaringClassSignature;
-      err = env->GetClassSignature(methodDeclaringClass,
-                                   &methodDeclaringClassSignature, nullptr);
-      check(err, "class sig");
-      char *sourceFileName;
-      err = env->GetSourceFileName(methodDeclaringClass, &sourceFileName);
-      std::string sourceName = "Unknown";
-      if (err == JVMTI_ERROR_NONE) {
-        sourceName = sourceFileName;
-        env->Deallocate((unsigned char *)sourceFileName);
-      }
-      std::string name(methodName);
-      std::string klassName(methodDeclaringClassSignature);
-      MethodInfo info{.name = name,
-                      .klass = klassName,
-                      .file = sourceName,
-                      .line = lineNumber};
-      {
-        // TODO: use different lock
-        const std::lock_guard<std::mutex> lock(write);
-        storage.AddMethod(methodId, info);
+      if (options.deferred_symbols) {
+        pinMethod(env, jni, method);
+        continue;
       }
 
-      env->Deallocate((unsigned char *)methodName);
-      env->Deallocate((unsigned char *)methodSignature);
-      env->Deallocate((unsigned char *)methodDeclaringClassSignature);
-      jni->DeleteLocalRef(methodDeclaringClass);
+      // A method that can't be symbolized is stored as unknown
+      auto start = std::chrono::steady_clock::now();
+      resolveMethod(env, jni, method);
+      stats.Add(AgentStats::kSymbolMisses);
+      stats.Record(AgentStats::kSymbolize, nanosSince(start));
     } // end loop
 
-    hash += hash << 3;
-    hash ^= hash >> 11;
+    if (stackId == 0) {
+      stackId = scope != nullptr ? scope->calls.Intern(frames, frame_count)
+                : options.call_tree
+                    ? storage.Calls().Intern(frames, frame_count)
+                    : storage.AddStackTrace(frames, frame_count);
+      stacks.Remember(frames, frame_count, stackId);
+    }
 
-    jweak ref = jni->NewWeakGlobalRef(object);
-    AllocationInfo info{.sizeBytes = size,
-                        .ref = reinterpret_cast<uintptr_t>(ref)};
+    if (scope != nullptr || options.call_tree) {
+      auto &calls = scope != nullptr ? scope->calls : storage.Calls();
+      calls.AddAllocation(stackId, size,
+                          samplingInterval.load(std::memory_order_relaxed));
+      return;
+    }
 
-    {
-      const std::lock_guard<std::mutex> lock(write);
-      storage.AddAllocation(hash, stack, info);
+    uintptr_t ref;
+    if (options.tag_liveness) {
+      auto tag = nextObjectTag.fetch_add(1, std::memory_order_relaxed);
+      if (env->SetTag(object, tag) != JVMTI_ERROR_NONE)
+        return;
+      ref = tag;
+    } else {
+      ref = reinterpret_cast<uintptr_t>(jni->NewWeakGlobalRef(object));
     }
+    AllocationInfo info{
+        .sizeBytes = size,
+        .ref = ref,
+        .intervalBytes = samplingInterval.load(std::memory_order_relaxed),
+        .timeNanos = wallClockNanos(),
+        .gcEpoch = gcEpoch.load(std::memory_order_relaxed)};
+
+    if (threadState.buffer == nullptr) {
+      threadState.buffer = sampleBuffers.Acquire();
+    }
+    threadState.buffer->Push(Sample{static_cast<long>(stackId), info});
   }
 }
 // }}}
 
 // {{{ Heapz.java native methods
 
+static std::string toString(JNIEnv *jni, jstring string) {
+  std::string result;
+  if (string == NULL)
+    return result;
+  result.resize(jni->GetStringUTFLength(string));
+  jni->GetStringUTFRegion(string, 0, jni->GetStringLength(string),
+                          result.data());
+  return result;
+}
+
 extern "C" {
 
 /*
@@ -337,7 +1365,9 @@ extern "C" {
  * Signature: ()V
  */
 JNIEXPORT void JNICALL Java_Heapz_startSampling(JNIEnv *jni, jclass klass) {
-  isProfiling.store(true, std::memory_order_relaxed);
+  const TimedLock lock(session);
+  if (!startSession())
+    return;
   LOG_INFO("Started sampling" << std::endl)
 }
 
@@ -347,10 +1377,178 @@ JNIEXPORT void JNICALL Java_Heapz_startSampling(JNIEnv *jni, jclass klass) {
  * Signature: ()V
  */
 JNIEXPORT void JNICALL Java_Heapz_stopSampling(JNIEnv *jni, jclass klass) {
-  isProfiling.store(false, std::memory_order_relaxed);
+  const TimedLock lock(session);
+  stopSession();
   LOG_INFO("Stopped sampling" << std::endl)
 }
 
+/*
+ * Class:     Heapz
+ * Method:    configure
+ * Signature: (Ljava/lang/String;)V
+ */
+JNIEXPORT void JNICALL Java_Heapz_configure(JNIEnv *jni, jclass klass,
+                                            jstring options) {
+  auto value = toString(jni, options);
+  const TimedLock lock(session);
+  auto parsed = parseOptions(value.c_str(), heapz_options);
+  // What is sampled and how it is stored is fixed at load time
+  heapz_options.sampling_interval = parsed.sampling_interval;
+  heapz_options.max_samples = parsed.max_samples;
+  heapz_options.max_samples_per_site = parsed.max_samples_per_site;
+  heapz_options.large_bytes = parsed.large_bytes;
+  heapz_options.max_frames = parsed.max_frames;
+  heapz_options.max_samples_per_sec = parsed.max_samples_per_sec;
+  heapz_options.max_overhead_permille = parsed.max_overhead_permille;
+  heapz_options.max_callback_p99_us = parsed.max_callback_p99_us;
+  applyOptions();
+  LOG_INFO("Reconfigured sampling" << std::endl)
+}
+
+/*
+ * Class:     Heapz
+ * Method:    beginScope
+ * Signature: ()V
+ */
+JNIEXPORT void JNICALL Java_Heapz_beginScope(JNIEnv *jni, jclass klass) {
+  if (threadState.scope != nullptr) {
+    jni->ThrowNew(jni->FindClass("java/lang/IllegalStateException"),
+                  "Already profiling this thread");
+    return;
+  }
+  auto scope = new Scope();
+  const TimedLock lock(session);
+  jthread thread = NULL;
+  auto err = heapz_jvmti->GetCurrentThread(&thread);
+  if (err == JVMTI_ERROR_NONE)
+    err = heapz_jvmti->SetThreadLocalStorage(thread, scope);
+  // A running session already set the interval
+  if (err == JVMTI_ERROR_NONE && !samplingEnabled &&
+      !setSamplingInterval(heapz_options.sampling_interval))
+    err = JVMTI_ERROR_INTERNAL;
+  if (err == JVMTI_ERROR_NONE)
+    err = heapz_jvmti->SetEventNotificationMode(
+        JVMTI_ENABLE, JVMTI_EVENT_SAMPLED_OBJECT_ALLOC, thread);
+  if (err != JVMTI_ERROR_NONE) {
+    if (thread != NULL)
+      heapz_jvmti->SetThreadLocalStorage(thread, nullptr);
+    delete scope;
+    LOG_ERROR("Can't profile thread, JVMTI error code " << err << std::endl)
+  } else {
+    threadState.scope = scope;
+    activeScopes++;
+  }
+  jni->DeleteLocalRef(thread);
+}
+
+/*
+ * Class:     Heapz
+ * Method:    endScope
+ * Signature: ()[B
+ */
+JNIEXPORT jbyteArray JNICALL Java_Heapz_endScope(JNIEnv *jni, jclass klass) {
+  auto scope = threadState.scope;
+  // Allocations of this method are not part of the scope
+  threadState.scope = nullptr;
+  std::vector<unsigned char> buffer;
+  if (scope != nullptr) {
+    {
+      const TimedLock lock(session);
+      jthread thread;
+      if (heapz_jvmti->GetCurrentThread(&thread) == JVMTI_ERROR_NONE) {
+        heapz_jvmti->SetThreadLocalStorage(thread, nullptr);
+        heapz_jvmti->SetEventNotificationMode(
+            JVMTI_DISABLE, JVMTI_EVENT_SAMPLED_OBJECT_ALLOC, thread);
+        // Back to what a filtered session decided for the thread
+        if (samplingEnabled && threadFilter.Active())
+          setThreadSamplingEvent(heapz_jvmti, jni, thread, true);
+        jni->DeleteLocalRef(thread);
+      }
+    }
+    {
+      const TimedLock lock(write);
+      releaseMethodPins(heapz_jvmti, jni, methodPins.exchange(
+                                              nullptr, std::memory_order_acquire));
+      buffer = exporter.ExportCallTree(scope->calls, agentStatComments());
+      recordExport();
+      delete scope;
+    }
+    // Generations its paths refer to may be reclaimed once it is exported
+    const TimedLock lock(session);
+    activeScopes--;
+  }
+  auto size = buffer.size();
+  jbyteArray result = jni->NewByteArray(size);
+  jni->SetByteArrayRegion(result, 0, size,
+                          reinterpret_cast<jbyte *>(buffer.data()));
+  return result;
+}
+
+/*
+ * Class:     Heapz
+ * Method:    setLabel
+ * Signature: (Ljava/lang/String;Ljava/lang/String;)V
+ */
+JNIEXPORT void JNICALL Java_Heapz_setLabel(JNIEnv *jni, jclass klass,
+                                           jstring key, jstring value) {
+  if (key == NULL)
+    return;
+  if (!SetLabel(threadState.labels, toString(jni, key), toString(jni, value)))
+    return;
+  const EpochGuard guard;
+  renewThreadState(guard.Epoch());
+  threadState.labelSet = storage.AddLabels(threadState.labels);
+}
+
+/*
+ * Class:     Heapz
+ * Method:    clearLabels
+ * Signature: ()V
+ */
+JNIEXPORT void JNICALL Java_Heapz_clearLabels(JNIEnv *jni, jclass klass) {
+  threadState.labels.clear();
+  threadState.labelSet = 0;
+}
+
+/*
+ * Class:     Heapz
+ * Method:    agentStats
+ * Signature: ()Ljava/lang/String;
+ */
+JNIEXPORT jstring JNICALL Java_Heapz_agentStats(JNIEnv *jni, jclass klass) {
+  std::ostringstream stats;
+  {
+    const TimedLock lock(write);
+    for (auto const &[name, value] : agentStatValues()) {
+      stats << name << "=" << value << "\n";
+    }
+  }
+  return jni->NewStringUTF(stats.str().c_str());
+}
+
+/*
+ * Class:     Heapz
+ * Method:    getLeakSuspects
+ * Signature: ()[B
+ */
+JNIEXPORT jbyteArray JNICALL Java_Heapz_getLeakSuspects(JNIEnv *jni,
+                                                        jclass klass) {
+  std::vector<unsigned char> buffer;
+  {
+    const TimedLock lock(write);
+    auto comments = agentStatComments();
+    comments.push_back("heapz: " + std::to_string(leaks.Snapshots()) +
+                       " GC snapshots of " + std::to_string(leaks.size()) +
+                       " sites");
+    buffer = exporter.ExportLeakSuspects(leaks.Suspects(), comments);
+  }
+  auto size = buffer.size();
+  jbyteArray result = jni->NewByteArray(size);
+  jni->SetByteArrayRegion(result, 0, size,
+                          reinterpret_cast<jbyte *>(buffer.data()));
+  return result;
+}
+
 /*
  * Class:     Heapz
  * Method:    getResults
@@ -363,12 +1561,6 @@ JNIEXPORT jbyteArray JNICALL Java_Heapz_getResults(JNIEnv *jni, jclass klass) {
   jbyteArray result = jni->NewByteArray(size);
   jni->SetByteArrayRegion(result, 0, size,
                           reinterpret_cast<jbyte *>(buffer.data()));
-  {
-    std::lock_guard<std::mutex> lock(write);
-    LOG_DEBUG("Clearing storage" << std::endl)
-    storage.Clear();
-    LOG_DEBUG("Done clearing storage" << std::endl)
-  }
   LOG_INFO("Got results, size is " << size << " bytes" << std::endl)
   return result;
 }
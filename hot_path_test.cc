@@ -0,0 +1,196 @@
+#include "gtest/gtest.h"
+#include "sample_buffer.h"
+#include "stack_memo.h"
+#include "storage.h"
+
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+// Counts operator new calls made by the current thread while enabled
+static thread_local bool countAllocations = false;
+static thread_local long allocations = 0;
+
+void *operator new(std::size_t size) {
+    if (countAllocations)
+        allocations++;
+    if (void *ptr = std::malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+
+class CountingScope {
+public:
+    CountingScope() {
+        allocations = 0;
+        countAllocations = true;
+    }
+    ~CountingScope() { countAllocations = false; }
+    long count() const { return allocations; }
+};
+
+static std::vector<jvmtiFrameInfo> framesOf(int depth, int seed) {
+    std::vector<jvmtiFrameInfo> frames;
+    for (int i = 0; i < depth; i++) {
+        frames.push_back({reinterpret_cast<jmethodID>(0x7f0000001000 + (i + seed) * 8),
+                          static_cast<jlocation>(i)});
+    }
+    return frames;
+}
+
+// Mirrors what SampledObjectAlloc does per sample once methods and stacks
+// have been seen: method lookups, stack interning and a buffer append
+TEST(HotPath, WarmSamplePathDoesNotAllocate) {
+
+    Storage storage;
+    SampleBuffer buffer;
+    std::vector<std::vector<jvmtiFrameInfo>> stacks;
+    for (int seed = 0; seed < 8; seed++) {
+        stacks.push_back(framesOf(64, seed));
+    }
+
+    auto sample = [&](const std::vector<jvmtiFrameInfo> &frames) {
+        for (auto const &frame : frames) {
+            auto methodId = reinterpret_cast<uintptr_t>(frame.method);
+            if (!storage.HasMethod(methodId))
+                storage.AddMethod(methodId, MethodInfo{.name = "m", .klass = 1});
+        }
+        auto stackId = storage.AddStackTrace(frames.data(), frames.size());
+        buffer.Push(Sample{stackId, AllocationInfo{.sizeBytes = 16, .ref = 0}});
+    };
+    auto drain = [&] { buffer.Drain([](Sample &&) {}); };
+
+    // warm up caches and the spare chunk list
+    for (int round = 0; round < 4; round++) {
+        for (size_t i = 0; i < SampleBuffer::kChunkSize * 4; i++) {
+            sample(stacks[i % stacks.size()]);
+        }
+        drain();
+    }
+
+    CountingScope scope;
+    for (int round = 0; round < 4; round++) {
+        for (size_t i = 0; i < SampleBuffer::kChunkSize * 4; i++) {
+            sample(stacks[i % stacks.size()]);
+        }
+        drain();
+    }
+    EXPECT_EQ(scope.count(), 0);
+}
+
+// Mirrors the deferred_symbols path: methods symbolized by a drain are not
+// pinned again, however many of them collide in the per-thread pin memo
+TEST(HotPath, WarmDeferredPathDoesNotPin) {
+
+    Storage storage;
+    SampleBuffer buffer;
+    std::vector<std::vector<jvmtiFrameInfo>> stacks;
+    // more methods than the 256 slots of the pin memo
+    for (int seed = 0; seed < 512; seed += 64) {
+        stacks.push_back(framesOf(64, seed));
+    }
+
+    std::vector<jmethodID> pins;
+    auto sample = [&](const std::vector<jvmtiFrameInfo> &frames) {
+        for (auto const &frame : frames) {
+            if (storage.HasMethod(reinterpret_cast<uintptr_t>(frame.method)))
+                continue;
+            pins.push_back(frame.method);
+        }
+        auto stackId = storage.AddStackTrace(frames.data(), frames.size());
+        buffer.Push(Sample{stackId, AllocationInfo{.sizeBytes = 16, .ref = 0}});
+    };
+    // symbolizes what was pinned, like releaseMethodPins
+    auto drain = [&] {
+        for (auto method : pins) {
+            storage.AddMethod(reinterpret_cast<uintptr_t>(method), MethodInfo{.name = "m", .klass = 1});
+        }
+        pins.clear();
+        buffer.Drain([](Sample &&) {});
+    };
+
+    for (int round = 0; round < 4; round++) {
+        for (size_t i = 0; i < SampleBuffer::kChunkSize * 4; i++) {
+            sample(stacks[i % stacks.size()]);
+        }
+        drain();
+    }
+
+    CountingScope scope;
+    for (size_t i = 0; i < SampleBuffer::kChunkSize * 4; i++) {
+        sample(stacks[i % stacks.size()]);
+    }
+    EXPECT_TRUE(pins.empty());
+    drain();
+    EXPECT_EQ(scope.count(), 0);
+}
+
+TEST(HotPath, WarmCallTreeDoesNotAllocate) {
+
+    CallTree tree;
+    auto frames = framesOf(64, 0);
+    tree.AddAllocation(frames.data(), frames.size(), 16);
+
+    CountingScope scope;
+    for (int i = 0; i < 1000; i++) {
+        tree.AddAllocation(frames.data(), frames.size(), 16);
+    }
+    EXPECT_EQ(scope.count(), 0);
+}
+
+TEST(HotPath, StackMemoHitDoesNotAllocate) {
+
+    StackMemo memo;
+    auto frames = framesOf(64, 0);
+    memo.Remember(frames.data(), frames.size(), 1);
+
+    CountingScope scope;
+    for (int i = 0; i < 1000; i++) {
+        EXPECT_EQ(memo.Find(frames.data(), frames.size()), 1);
+    }
+    EXPECT_EQ(scope.count(), 0);
+}
+
+TEST(HotPath, SpareChunksAreBounded) {
+
+    SampleBuffer buffer;
+    for (size_t i = 0; i < SampleBuffer::kChunkSize * (SampleBuffer::kMaxSpareChunks + 8); i++) {
+        buffer.Push(Sample{1, AllocationInfo{.sizeBytes = 16, .ref = 0}});
+    }
+    buffer.Drain([](Sample &&) {});
+    EXPECT_EQ(buffer.SpareChunks(), SampleBuffer::kMaxSpareChunks);
+}
+
+// Methods sampled in a window are carried to the next generation, so after a
+// rotation the method lookups of warm stacks still hit and do not allocate
+TEST(HotPath, RotationKeepsWarmMethods) {
+
+    Storage storage;
+    std::vector<std::vector<jvmtiFrameInfo>> stacks;
+    for (int seed = 0; seed < 512; seed += 64) {
+        stacks.push_back(framesOf(64, seed));
+    }
+    for (auto const &frames : stacks) {
+        for (auto const &frame : frames) {
+            storage.AddMethod(reinterpret_cast<uintptr_t>(frame.method), MethodInfo{.name = "m", .klass = 1});
+        }
+        storage.AddStackTrace(frames.data(), frames.size());
+    }
+
+    storage.Rotate();
+    storage.Reclaim();
+
+    long misses = 0;
+    CountingScope scope;
+    for (auto const &frames : stacks) {
+        for (auto const &frame : frames) {
+            if (!storage.HasMethod(reinterpret_cast<uintptr_t>(frame.method)))
+                misses++;
+        }
+    }
+    EXPECT_EQ(misses, 0);
+    EXPECT_EQ(scope.count(), 0);
+}
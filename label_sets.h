@@ -0,0 +1,96 @@
+#ifndef LABEL_SETS_H_
+#define LABEL_SETS_H_
+
+// {{{ Includes
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "concurrent_map.h"
+#include "stack_table.h"
+//  }}}
+
+// {{{ Data
+// Context labels of a sample, sorted by key
+using Labels = std::vector<std::pair<std::string, std::string>>;
+
+// Sets key to value in sorted labels, an empty value removes the key.
+// Returns false if the labels were already like that.
+inline bool SetLabel(Labels &labels, const std::string &key,
+                     const std::string &value) {
+  auto it = std::lower_bound(
+      labels.begin(), labels.end(), key,
+      [](const std::pair<std::string, std::string> &label,
+         const std::string &key) { return label.first < key; });
+  bool found = it != labels.end() && it->first == key;
+  if (value.empty()) {
+    if (!found)
+      return false;
+    labels.erase(it);
+  } else if (found) {
+    if (it->second == value)
+      return false;
+    it->second = value;
+  } else {
+    labels.insert(it, {key, value});
+  }
+  return true;
+}
+// }}}
+
+/**
+ * Interning table for label sets.
+ *
+ * Samples carry the id of their label set instead of strings. Ids are
+ * derived from a hash of the labels like stack ids, equal sets always get
+ * the same id, 0 stands for no labels. Intern and Get are lock-free.
+ */
+class LabelSets {
+public:
+  uint64_t Intern(const Labels &labels) {
+    if (labels.empty())
+      return 0;
+    return InternByHash(
+        sets_, Hash(labels), kSeed, [&labels] { return labels; },
+        [&labels](const Labels &set) { return set == labels; });
+  }
+
+  // Returns nullptr for 0 or an unknown id
+  const Labels *Get(uint64_t id) const {
+    return id == 0 ? nullptr : sets_.Find(id);
+  }
+
+  // Stores labels under the id another table gave them, requires no
+  // concurrent users
+  void Adopt(uint64_t id, const Labels &labels) { sets_.Insert(id, labels); }
+
+  size_t size() const { return sets_.size(); }
+
+  // Requires no concurrent readers or writers
+  void Clear() { sets_.Clear(); }
+
+private:
+  static constexpr uint64_t kSeed = 0x9e3779b97f4a7c15ULL;
+
+  static uint64_t HashString(uint64_t hash, const std::string &value) {
+    hash = HashMix(hash ^ value.size(), kSeed);
+    for (unsigned char c : value) {
+      hash = (hash ^ c) * 0x100000001b3ULL;
+    }
+    return hash;
+  }
+
+  static uint64_t Hash(const Labels &labels) {
+    uint64_t hash = HashMix(labels.size(), kSeed);
+    for (auto const &[key, value] : labels) {
+      hash = HashString(HashString(hash, key), value);
+    }
+    return HashMix(hash, kSeed);
+  }
+
+  ConcurrentMap<Labels> sets_;
+};
+
+#endif // LABEL_SETS_H_
@@ -0,0 +1,62 @@
+#include "gtest/gtest.h"
+#include "label_sets.h"
+
+#include <set>
+#include <thread>
+#include <vector>
+
+TEST(Labels, SetLabel) {
+
+    Labels labels;
+    EXPECT_TRUE(SetLabel(labels, "tenant", "a"));
+    EXPECT_TRUE(SetLabel(labels, "endpoint", "/search"));
+    EXPECT_FALSE(SetLabel(labels, "tenant", "a"));
+    EXPECT_EQ(labels, (Labels{{"endpoint", "/search"}, {"tenant", "a"}}));
+
+    EXPECT_TRUE(SetLabel(labels, "tenant", "b"));
+    EXPECT_EQ(labels[1].second, "b");
+
+    // an empty value removes the label
+    EXPECT_TRUE(SetLabel(labels, "endpoint", ""));
+    EXPECT_FALSE(SetLabel(labels, "missing", ""));
+    EXPECT_EQ(labels, (Labels{{"tenant", "b"}}));
+}
+
+TEST(LabelSets, Intern) {
+
+    LabelSets underTest;
+    EXPECT_EQ(underTest.Intern({}), 0);
+    EXPECT_EQ(underTest.Get(0), nullptr);
+
+    Labels search{{"endpoint", "/search"}};
+    Labels searchA{{"endpoint", "/search"}, {"tenant", "a"}};
+    auto id = underTest.Intern(search);
+    EXPECT_NE(id, 0);
+    EXPECT_EQ(underTest.Intern(search), id);
+    EXPECT_NE(underTest.Intern(searchA), id);
+    EXPECT_EQ(*underTest.Get(id), search);
+    EXPECT_EQ(underTest.size(), 2);
+}
+
+TEST(LabelSets, ConcurrentIntern) {
+
+    LabelSets underTest;
+    std::vector<std::set<uint64_t>> ids(4);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&underTest, &ids, t] {
+            for (int i = 0; i < 1000; i++) {
+                ids[t].insert(underTest.Intern({{"tenant", std::to_string(i % 100)}}));
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    for (auto const &threadIds : ids) {
+        EXPECT_EQ(threadIds, ids[0]);
+    }
+    EXPECT_EQ(ids[0].size(), 100);
+    EXPECT_EQ(underTest.size(), 100);
+}
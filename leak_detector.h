@@ -0,0 +1,149 @@
+#ifndef LEAK_DETECTOR_H_
+#define LEAK_DETECTOR_H_
+
+// {{{ Includes
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+//  }}}
+
+/**
+ * Spots allocation sites whose in-use memory keeps growing.
+ *
+ * Every garbage collection adds a snapshot of the estimated in-use bytes and
+ * objects of each site, the last kPoints snapshots are kept. Sites are ranked
+ * by the least squares slope of their in-use bytes times how consistently
+ * they grew from one snapshot to the next: a slow leak grows a little at
+ * almost every collection, a cache or a burst does not.
+ *
+ * Not thread-safe, used under the storage lock.
+ */
+class LeakDetector {
+public:
+  static constexpr size_t kPoints = 64;
+  // Fewer snapshots say nothing about a trend
+  static constexpr size_t kMinPoints = 4;
+
+  struct Suspect {
+    long site;
+    double bytesPerSec; // least squares growth of in-use bytes
+    double consistency; // share of snapshots in-use bytes grew at, 0..1
+    double bytes;       // in use at the last snapshot
+    double count;
+  };
+
+  /**
+   * Adds a snapshot taken at timeNanos
+   *
+   * @param inUse estimated in-use bytes and objects by site, sites missing
+   * from it have none
+   */
+  void Snapshot(long timeNanos,
+                const std::unordered_map<long, std::pair<double, double>>
+                    &inUse) {
+    auto slot = snapshots_ % kPoints;
+    times_[slot] = timeNanos;
+    for (auto const &[site, values] : inUse) {
+      if (values.first <= 0)
+        continue;
+      auto [it, added] = sites_.try_emplace(site);
+      if (added)
+        it->second.first = snapshots_;
+      it->second.lastInUse = snapshots_;
+    }
+    for (auto it = sites_.begin(); it != sites_.end();) {
+      auto &series = it->second;
+      if (snapshots_ - series.lastInUse >= kPoints) {
+        it = sites_.erase(it);
+        continue;
+      }
+      auto values = inUse.find(it->first);
+      series.bytes[slot] = values == inUse.end() ? 0 : values->second.first;
+      series.counts[slot] = values == inUse.end() ? 0 : values->second.second;
+      ++it;
+    }
+    snapshots_++;
+  }
+
+  // Sites that grew, most suspect first
+  std::vector<Suspect> Suspects() const {
+    std::vector<std::pair<double, Suspect>> ranked;
+    for (auto const &[site, series] : sites_) {
+      auto points = std::min<uint64_t>(kPoints, snapshots_ - series.first);
+      if (points < kMinPoints)
+        continue;
+      auto start = snapshots_ - points;
+      double meanTime = 0, meanBytes = 0;
+      for (auto i = start; i < snapshots_; i++) {
+        meanTime += Seconds(i);
+        meanBytes += series.bytes[i % kPoints];
+      }
+      meanTime /= points;
+      meanBytes /= points;
+      double covariance = 0, variance = 0;
+      size_t grew = 0;
+      for (auto i = start; i < snapshots_; i++) {
+        auto time = Seconds(i) - meanTime;
+        covariance += time * (series.bytes[i % kPoints] - meanBytes);
+        variance += time * time;
+        if (i > start &&
+            series.bytes[i % kPoints] > series.bytes[(i - 1) % kPoints])
+          grew++;
+      }
+      if (variance <= 0 || covariance <= 0)
+        continue;
+      auto last = (snapshots_ - 1) % kPoints;
+      Suspect suspect{.site = site,
+                      .bytesPerSec = covariance / variance,
+                      .consistency = static_cast<double>(grew) / (points - 1),
+                      .bytes = series.bytes[last],
+                      .count = series.counts[last]};
+      ranked.push_back(
+          {suspect.bytesPerSec * suspect.consistency * suspect.consistency,
+           suspect});
+    }
+    std::sort(ranked.begin(), ranked.end(),
+              [](auto const &a, auto const &b) { return a.first > b.first; });
+    std::vector<Suspect> suspects;
+    for (auto const &[score, suspect] : ranked) {
+      suspects.push_back(suspect);
+    }
+    return suspects;
+  }
+
+  // Sites with a series, their stacks must stay resolvable
+  std::vector<long> Sites() const {
+    std::vector<long> sites;
+    sites.reserve(sites_.size());
+    for (auto const &[site, series] : sites_) {
+      sites.push_back(site);
+    }
+    return sites;
+  }
+
+  size_t size() const { return sites_.size(); }
+  uint64_t Snapshots() const { return snapshots_; }
+
+private:
+  struct Series {
+    uint64_t first = 0;     // snapshot the site was first in use at
+    uint64_t lastInUse = 0; // snapshot the site was last in use at
+    // by snapshot modulo kPoints, floats are precise enough for a trend
+    std::array<float, kPoints> bytes{};
+    std::array<float, kPoints> counts{};
+  };
+
+  double Seconds(uint64_t snapshot) const {
+    return (times_[snapshot % kPoints] - times_[(snapshots_ - 1) % kPoints]) /
+           1e9;
+  }
+
+  std::array<long, kPoints> times_{};
+  std::unordered_map<long, Series> sites_;
+  uint64_t snapshots_ = 0;
+};
+
+#endif // LEAK_DETECTOR_H_
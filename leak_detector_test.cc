@@ -0,0 +1,50 @@
+#include "gtest/gtest.h"
+#include "leak_detector.h"
+
+static const long kSecond = 1000000000;
+
+TEST(LeakDetector, NeedsEnoughSnapshots) {
+
+    LeakDetector underTest;
+    for (long i = 0; i < LeakDetector::kMinPoints - 1; i++) {
+        underTest.Snapshot(i * kSecond, {{1, {1000.0 * (i + 1), 10.0}}});
+    }
+    EXPECT_TRUE(underTest.Suspects().empty());
+}
+
+TEST(LeakDetector, RanksSteadyGrowthFirst) {
+
+    LeakDetector underTest;
+    for (long i = 0; i < 20; i++) {
+        underTest.Snapshot(i * kSecond, {
+            // leaks 100 bytes a second
+            {1, {1000.0 + 100 * i, 10.0 + i}},
+            // grows faster, but in a sawtooth
+            {2, {i % 2 == 0 ? 1000.0 + 300 * i : 500.0, 10.0}},
+            // stable
+            {3, {5000.0, 50.0}},
+        });
+    }
+
+    auto suspects = underTest.Suspects();
+    ASSERT_EQ(suspects.size(), 2);
+    EXPECT_EQ(suspects[0].site, 1);
+    EXPECT_NEAR(suspects[0].bytesPerSec, 100, 1e-6);
+    EXPECT_EQ(suspects[0].consistency, 1);
+    EXPECT_EQ(suspects[0].bytes, 2900);
+    EXPECT_EQ(suspects[0].count, 29);
+    EXPECT_EQ(suspects[1].site, 2);
+    EXPECT_LT(suspects[1].consistency, 0.6);
+}
+
+TEST(LeakDetector, ForgetsSitesNoLongerInUse) {
+
+    LeakDetector underTest;
+    underTest.Snapshot(0, {{1, {1000.0, 1.0}}});
+    EXPECT_EQ(underTest.Sites(), std::vector<long>{1});
+    for (long i = 1; i <= LeakDetector::kPoints; i++) {
+        underTest.Snapshot(i * kSecond, {});
+    }
+    EXPECT_EQ(underTest.size(), 0);
+    EXPECT_TRUE(underTest.Sites().empty());
+}
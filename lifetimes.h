@@ -0,0 +1,67 @@
+#ifndef LIFETIMES_H_
+#define LIFETIMES_H_
+
+// {{{ Includes
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <map>
+
+#include "agent_stats.h"
+//  }}}
+
+/**
+ * Weighted distribution of the lifetimes of dead sampled objects of a site,
+ * in nanoseconds and in garbage collections survived.
+ *
+ * Nanoseconds use the log-linear buckets of HdrHistogram, only those in use
+ * are stored, collections one bucket each up to kMaxGcs. Not thread-safe,
+ * used under the storage lock.
+ */
+class Lifetimes {
+public:
+  // Objects surviving more collections all go in the last bucket
+  static constexpr size_t kMaxGcs = 15;
+
+  void Add(uint64_t nanos, uint64_t gcs, double weight) {
+    nanos_[HdrHistogram::BucketOf(nanos)] += weight;
+    gcs_[std::min<uint64_t>(gcs, kMaxGcs)] += weight;
+    weight_ += weight;
+  }
+
+  bool empty() const { return weight_ == 0; }
+
+  // Upper bound of the bucket holding the given quantile, 0 if empty
+  uint64_t NanosQuantile(double quantile) const {
+    if (empty())
+      return 0;
+    double rank = quantile * weight_;
+    double seen = 0;
+    for (auto const &[bucket, weight] : nanos_) {
+      seen += weight;
+      if (seen >= rank)
+        return HdrHistogram::UpperBound(bucket);
+    }
+    return HdrHistogram::UpperBound(nanos_.rbegin()->first);
+  }
+
+  uint64_t GcsQuantile(double quantile) const {
+    if (empty())
+      return 0;
+    double rank = quantile * weight_;
+    double seen = 0;
+    for (size_t i = 0; i < kMaxGcs; i++) {
+      seen += gcs_[i];
+      if (seen >= rank && gcs_[i] > 0)
+        return i;
+    }
+    return kMaxGcs;
+  }
+
+private:
+  std::map<size_t, double> nanos_;
+  std::array<double, kMaxGcs + 1> gcs_{};
+  double weight_ = 0;
+};
+
+#endif // LIFETIMES_H_
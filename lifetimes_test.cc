@@ -0,0 +1,26 @@
+#include "gtest/gtest.h"
+#include "lifetimes.h"
+
+TEST(Lifetimes, Empty) {
+
+    Lifetimes underTest;
+    EXPECT_TRUE(underTest.empty());
+    EXPECT_EQ(underTest.NanosQuantile(0.5), 0);
+    EXPECT_EQ(underTest.GcsQuantile(0.5), 0);
+}
+
+TEST(Lifetimes, WeightedQuantiles) {
+
+    Lifetimes underTest;
+    // young garbage
+    underTest.Add(1000, 0, 90);
+    // long-lived, promoted
+    underTest.Add(5000000000, 20, 10);
+
+    EXPECT_FALSE(underTest.empty());
+    EXPECT_GE(underTest.NanosQuantile(0.5), 1000);
+    EXPECT_LT(underTest.NanosQuantile(0.5), 1200);
+    EXPECT_GE(underTest.NanosQuantile(0.99), 5000000000);
+    EXPECT_EQ(underTest.GcsQuantile(0.5), 0);
+    EXPECT_EQ(underTest.GcsQuantile(0.99), Lifetimes::kMaxGcs);
+}
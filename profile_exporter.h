@@ -1,8 +1,16 @@
 #ifndef PROFILE_EXPORTER_H_
 #define PROFILE_EXPORTER_H_
 
+#include "leak_detector.h"
+#include "lifetimes.h"
 #include "storage.h"
+#include "upscaling.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <functional>
+#include <map>
+#include <string>
 #include <vector>
 #include <memory>
 
@@ -15,72 +23,247 @@ public:
   virtual void AddLocation(long functionId, long line) = 0;
   virtual void AddFunction(long id, std::string file, std::string name) = 0;
   virtual std::vector<unsigned char> Serialize() = 0;
+  // Samples carry no in-use values
+  virtual void SetAllocationOnly() {}
+  virtual void AddComment(std::string comment) {}
+  // Context label of the last added sample
+  virtual void AddLabel(std::string key, std::string value) {}
+  // Numeric label of the last added sample
+  virtual void AddNumLabel(std::string key, long value, std::string unit) {}
+  // Bytes between samples, 0 if every allocation was recorded
+  virtual void SetPeriod(long intervalBytes) {}
+  // Wall clock time the profile is as of, in nanoseconds since the epoch
+  virtual void SetTime(long timeNanos) {}
+  // Byte-seconds the objects of the last added sample were alive for
+  virtual void AddFootprint(long byteSeconds) {}
 };
 
 class ProfileExporter {
 public:
   ProfileExporter(Storage &storage) : storage_(storage) {}
+
+  /**
+   * Nominal interval reported as the profile period. Exported values are
+   * estimates of what was allocated, every sample being upscaled by the
+   * interval in effect when it was taken.
+   */
+  void SetSamplingInterval(long intervalBytes) {
+    samplingInterval_ = intervalBytes;
+  }
+  // Durations of the phases of the last export
+  struct Phases {
+    uint64_t livenessNanos = 0;
+    uint64_t serializeNanos = 0;
+  };
+  const Phases &LastExport() const { return lastExport_; }
+
   /**
    * Exports heap profile to a sequence of bytes
    *
-   * @param objectRefCallback operation to run on stored object references.
+   * @param objectRefCallback operation to run on stored allocations.
    * Callback should return true if object is still in use.
+   * @param comments added to the profile
+   * @param timeNanos time in-use values are as of, 0 if unknown. Objects
+   * still in use count towards footprint until then.
    *
    */
   std::vector<unsigned char>
-  ExportHeapProfile(std::function<bool(uintptr_t)> objectRefCallback) {
+  ExportHeapProfile(std::function<bool(const AllocationInfo &)> objectRefCallback,
+                    const std::vector<std::string> &comments = {},
+                    long timeNanos = 0) {
 
     auto profile = Profile::Create();
+    lastExport_ = Phases();
 
-    if (storage_.allocations.empty()) {
+    if (storage_.allocations.empty() && storage_.folded.empty()) {
       return std::vector<unsigned char>(0);
     }
+    profile->SetPeriod(samplingInterval_);
+    if (timeNanos > 0)
+      profile->SetTime(timeNanos);
+    AddComments(*profile, comments);
 
-    auto currentStackId = storage_.allocations.begin()->first;
-    auto sentinel = currentStackId + 1; // fake last element
-    storage_.allocations.insert({sentinel, AllocationInfo{}});
-    jlong currentAllocSize = 0;
-    jlong currentAllocCount = 0;
-    jlong currentUsedSize = 0;
-    jlong currentUsedCount = 0;
-    auto allocation = storage_.allocations.begin();
-    while (allocation != storage_.allocations.end()) {
-      auto stackId = allocation->first;
-      auto allocationInfo = allocation->second;
-      storage_.allocations.erase(allocation++);
-      // Requires sentinel as the last element
-      if (stackId != currentStackId && currentAllocCount > 0) {
-        auto stack = storage_.GetStackTrace(currentStackId);
-        profile->AddSample(currentAllocCount, currentAllocSize,
-                           currentUsedCount, currentUsedSize);
-        for (auto const &methodId : stack.GetFrames()) {
-          auto method = storage_.GetMethod(methodId);
-          profile->AddLocation(methodId, method.line);
-        }
-        currentStackId = stackId;
-        currentUsedSize = currentUsedCount = currentAllocSize =
-            currentAllocCount = 0;
+    // Samples compacted since the last export are dead, only the ones still
+    // stored need the liveness check
+    auto start = std::chrono::steady_clock::now();
+    std::map<long, SiteEstimate> sites(storage_.folded.begin(),
+                                       storage_.folded.end());
+    storage_.allocations.ForEach([&](long id,
+                                     const AllocationInfo &allocationInfo,
+                                     double retained) {
+      sites[id].Add(allocationInfo, retained, objectRefCallback(allocationInfo),
+                    timeNanos);
+    });
+    lastExport_.livenessNanos = NanosSince(start);
+
+    for (auto const &[stackId, site] : sites) {
+      auto const &alloc = site.alloc;
+      auto const &used = site.used;
+      auto const &lifetimes = site.lifetimes;
+      profile->AddSample(Round(alloc.Count()), Round(alloc.Bytes()),
+                         Round(used.Count()), Round(used.Bytes()));
+      profile->AddFootprint(Round(site.byteNanos / 1e9));
+      AddStack(*profile, storage_.GetStackTrace(stackId).GetFrames());
+      profile->AddNumLabel("alloc_space_error", Round(alloc.BytesError()),
+                           "bytes");
+      profile->AddNumLabel("inuse_space_error", Round(used.BytesError()),
+                           "bytes");
+      if (!lifetimes.empty()) {
+        profile->AddNumLabel("lifetime_p50", lifetimes.NanosQuantile(0.5),
+                             "nanoseconds");
+        profile->AddNumLabel("lifetime_p99", lifetimes.NanosQuantile(0.99),
+                             "nanoseconds");
+        profile->AddNumLabel("gcs_survived_p50", lifetimes.GcsQuantile(0.5),
+                             "count");
+        profile->AddNumLabel("gcs_survived_p99", lifetimes.GcsQuantile(0.99),
+                             "count");
       }
+    }
+
+    auto thinned = storage_.allocations.Thinned();
+    if (thinned > 0) {
+      profile->AddComment("heapz: " + std::to_string(thinned) +
+                          " samples thinned by retention");
+    }
+    storage_.ClearAllocations();
 
-      currentAllocCount++;
-      currentAllocSize += allocationInfo.sizeBytes;
+    AddFunctions(*profile);
+    return Serialize(*profile);
+  }
 
-      if (objectRefCallback(allocationInfo.ref)) {
-        currentUsedCount++;
-        currentUsedSize += allocationInfo.sizeBytes;
-      }
+  /**
+   * Exports allocations aggregated in the calling-context trees of every
+   * storage generation since the last export. Liveness is not tracked per
+   * call path, in-use values are zero.
+   */
+  std::vector<unsigned char>
+  ExportCallTree(const std::vector<std::string> &comments = {}) {
+    auto profile = CallTreeProfile(comments);
+    bool empty = true;
+    storage_.ForEachCallTree([this, &profile, &empty](CallTree &calls) {
+      if (AddCallPaths(*profile, calls))
+        empty = false;
+    });
+    if (empty) {
+      return std::vector<unsigned char>(0);
     }
+    AddFunctions(*profile);
+    return Serialize(*profile);
+  }
 
-    for (auto const &method : storage_.methods) {
-      profile->AddFunction(method.first, method.second.file,
-                           method.second.name);
+  // Same for a tree other than the storage's, methods come from the storage
+  std::vector<unsigned char>
+  ExportCallTree(CallTree &calls,
+                 const std::vector<std::string> &comments = {}) {
+    auto profile = CallTreeProfile(comments);
+    if (!AddCallPaths(*profile, calls)) {
+      return std::vector<unsigned char>(0);
     }
+    AddFunctions(*profile);
+    return Serialize(*profile);
+  }
 
-    return profile->Serialize();
+  /**
+   * Exports sites whose in-use memory grows, most suspect first. Values are
+   * what was in use at the last snapshot, labels carry the growth rate and
+   * how consistent it was.
+   */
+  std::vector<unsigned char>
+  ExportLeakSuspects(const std::vector<LeakDetector::Suspect> &suspects,
+                     const std::vector<std::string> &comments = {}) {
+    if (suspects.empty()) {
+      return std::vector<unsigned char>(0);
+    }
+    auto profile = Profile::Create();
+    lastExport_ = Phases();
+    profile->SetPeriod(samplingInterval_);
+    AddComments(*profile, comments);
+    for (auto const &suspect : suspects) {
+      profile->AddSample(0, 0, Round(suspect.count), Round(suspect.bytes));
+      AddStack(*profile, storage_.GetStackTrace(suspect.site).GetFrames());
+      profile->AddNumLabel("growth", Round(suspect.bytesPerSec),
+                           "bytes_per_second");
+      profile->AddNumLabel("consistency", Round(suspect.consistency * 100),
+                           "percent");
+    }
+    AddFunctions(*profile);
+    return Serialize(*profile);
   }
 
 private:
+  static long Round(double value) { return std::llround(value); }
+
+  static uint64_t NanosSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+  }
+
+  static void AddComments(Profile &profile,
+                          const std::vector<std::string> &comments) {
+    for (auto const &comment : comments) {
+      profile.AddComment(comment);
+    }
+  }
+
+  std::unique_ptr<Profile>
+  CallTreeProfile(const std::vector<std::string> &comments) {
+    auto profile = Profile::Create();
+    lastExport_ = Phases();
+    profile->SetAllocationOnly();
+    profile->SetPeriod(samplingInterval_);
+    AddComments(*profile, comments);
+    return profile;
+  }
+
+  // Drains the tree into the profile, false if it held no samples
+  bool AddCallPaths(Profile &profile, CallTree &calls) {
+    bool added = false;
+    calls.Drain([this, &profile, &added](long, const Estimate &alloc,
+                                         const std::vector<Frame> &stack) {
+      added = true;
+      profile.AddSample(Round(alloc.Count()), Round(alloc.Bytes()), 0, 0);
+      AddStack(profile, stack);
+      profile.AddNumLabel("alloc_space_error", Round(alloc.BytesError()),
+                          "bytes");
+    });
+    return added;
+  }
+
+  std::vector<unsigned char> Serialize(Profile &profile) {
+    auto start = std::chrono::steady_clock::now();
+    auto buffer = profile.Serialize();
+    lastExport_.serializeNanos = NanosSince(start);
+    return buffer;
+  }
+
+  // Frames of the last added sample, a label frame becomes its labels
+  void AddStack(Profile &profile, const std::vector<Frame> &stack) {
+    for (auto const &frame : stack) {
+      if (frame.method == kLabelsMethod) {
+        auto labels = storage_.GetLabels(frame.location);
+        for (auto const &[key, value] : labels ? *labels : Labels()) {
+          profile.AddLabel(key, value);
+        }
+        continue;
+      }
+      auto &method = storage_.GetMethod(frame.method);
+      profile.AddLocation(frame.method, method.lines.LineOf(frame.location));
+    }
+  }
+
+  void AddFunctions(Profile &profile) {
+    profile.AddFunction(kTruncatedMethod, "", "[truncated]");
+    storage_.ForEachMethod(
+        [this, &profile](uintptr_t id, const MethodInfo &method) {
+          profile.AddFunction(id, storage_.GetClass(method.klass).file,
+                              method.name);
+        });
+  }
+
   Storage &storage_;
+  long samplingInterval_ = 0;
+  Phases lastExport_;
 };
 
 #endif // PROFILE_EXPORTER_H_
@@ -14,11 +14,16 @@ public:
   void AddLocation(long functionId, long line) override;
   void AddFunction(long id, std::string file, std::string name) override;
   std::vector<unsigned char> Serialize() override;
+  void SetAllocationOnly() override { alloc_only_ = true; }
+  void AddLabel(std::string key, std::string value) override;
 
 private:
+  bool alloc_only_ = false;
   std::unordered_map<long, std::string> function_names_;
   // { [allocBytes, usedBytes], [topFrame, line], ..., [bottomFrame, line] }*
   std::vector<std::vector<std::pair<long, long>>> frames_;
+  // Labels of each stack as a root frame, "key=value,key=value"
+  std::vector<std::string> labels_;
 };
 
 std::unique_ptr<Profile> Profile::Create() {
@@ -29,6 +34,12 @@ void FlameGraphProfile::AddSample(long allocCount, long allocSize,
                                   long usedCount, long usedSize) {
   frames_.push_back(std::vector<std::pair<long, long>>());
   frames_.back().push_back({allocSize, usedSize});
+  labels_.push_back("");
+}
+
+void FlameGraphProfile::AddLabel(std::string key, std::string value) {
+  auto &labels = labels_.back();
+  labels += (labels.empty() ? "" : ",") + key + "=" + value;
 }
 
 void FlameGraphProfile::AddLocation(long functionId, long line) {
@@ -40,7 +51,7 @@ void FlameGraphProfile::AddFunction(long id, std::string file,
   auto extension_pos = file.find_last_of(".");
   auto class_name =
       extension_pos == std::string::npos ? file : file.substr(0, extension_pos);
-  function_names_[id] = class_name + "::" + name;
+  function_names_[id] = class_name.empty() ? name : class_name + "::" + name;
 }
 
 // Format: stackBottom; ...; stackTop size
@@ -48,10 +59,15 @@ std::vector<unsigned char> FlameGraphProfile::Serialize() {
 
   std::stringstream ss;
 
-  for (auto const &stack : frames_) {
+  for (size_t i = 0; i < frames_.size(); i++) {
+    auto const &stack = frames_[i];
     auto [allocBytes, usedBytes] = *stack.begin();
+    auto bytes = alloc_only_ ? allocBytes : usedBytes;
     auto it = stack.rbegin();
-    if (usedBytes > 0) {
+    if (bytes > 0) {
+      if (!labels_[i].empty()) {
+        ss << labels_[i] << (stack.size() > 1 ? ";" : "");
+      }
       while (it != stack.rend() - 1) {
         auto [id, line] = *it;
         ss << function_names_[id] << ":" << line;
@@ -60,7 +76,7 @@ std::vector<unsigned char> FlameGraphProfile::Serialize() {
         }
         it += 1;
       }
-      ss << " " << usedBytes << std::endl;
+      ss << " " << bytes << std::endl;
     }
   }
 
@@ -30,11 +30,22 @@ public:
       sampleType->set_type(Retain("inuse_space"));
       sampleType->set_unit(Retain("bytes"));
     }
+    {
+      auto sampleType = profile_.add_sample_type();
+      sampleType->set_type(Retain("footprint"));
+      sampleType->set_unit(Retain("byte_seconds"));
+    }
   }
   void AddSample(long allocCount, long allocSize, long usedCount,
                  long usedSize) override;
   void AddLocation(long functionId, long line) override;
   void AddFunction(long id, std::string file, std::string name) override;
+  void AddComment(std::string comment) override;
+  void AddLabel(std::string key, std::string value) override;
+  void AddNumLabel(std::string key, long value, std::string unit) override;
+  void SetPeriod(long intervalBytes) override;
+  void SetTime(long timeNanos) override;
+  void AddFootprint(long byteSeconds) override;
   std::vector<unsigned char> Serialize() override;
   int Retain(std::string string) {
     if (seen_strings_.contains(string)) {
@@ -63,6 +74,7 @@ void PProfProfile::AddSample(long allocCount, long allocSize, long usedCount,
   sample->add_value(allocSize);
   sample->add_value(usedCount);
   sample->add_value(usedSize);
+  sample->add_value(0); // footprint
   current_sample_ = sample;
 }
 
@@ -85,6 +97,39 @@ void PProfProfile::AddFunction(long id, std::string file, std::string name) {
   function->set_system_name(Retain(name));
 }
 
+void PProfProfile::AddLabel(std::string key, std::string value) {
+  auto label = current_sample_->add_label();
+  label->set_key(Retain(key));
+  label->set_str(Retain(value));
+}
+
+void PProfProfile::AddNumLabel(std::string key, long value,
+                               std::string unit) {
+  auto label = current_sample_->add_label();
+  label->set_key(Retain(key));
+  label->set_num(value);
+  label->set_num_unit(Retain(unit));
+}
+
+void PProfProfile::SetPeriod(long intervalBytes) {
+  auto periodType = profile_.mutable_period_type();
+  periodType->set_type(Retain("space"));
+  periodType->set_unit(Retain("bytes"));
+  profile_.set_period(intervalBytes);
+}
+
+void PProfProfile::AddFootprint(long byteSeconds) {
+  current_sample_->set_value(4, byteSeconds);
+}
+
+void PProfProfile::SetTime(long timeNanos) {
+  profile_.set_time_nanos(timeNanos);
+}
+
+void PProfProfile::AddComment(std::string comment) {
+  profile_.add_comment(Retain(comment));
+}
+
 std::vector<unsigned char> PProfProfile::Serialize() {
   auto size = profile_.ByteSizeLong();
   auto buffer = std::vector<unsigned char>(size);
@@ -0,0 +1,239 @@
+#ifndef RESERVOIR_H_
+#define RESERVOIR_H_
+
+// {{{ Includes
+#include <algorithm>
+#include <cstddef>
+#include <map>
+#include <optional>
+#include <random>
+#include <unordered_map>
+#include <utility>
+//  }}}
+
+/**
+ * Bounded store of the samples of one profiling window, keyed by site.
+ *
+ * Every sample draws a random priority and the store keeps the samples with
+ * the lowest ones: at most maxSamples overall and, optionally, at most
+ * maxSamplesPerSite per site so that a hot site cannot crowd out rare ones.
+ * A kept sample stands for 1 / min(site threshold, global threshold) samples,
+ * thresholds being the lowest priority turned away so far. Samples of at
+ * least largeBytes go to a separate lane and are never thinned.
+ *
+ * Values need a sizeBytes field. Not thread-safe, used by the single drainer.
+ */
+template <typename V> class Reservoir {
+public:
+  struct Options {
+    size_t maxSamples = 0;        // 0 keeps every sample
+    size_t maxSamplesPerSite = 0; // 0 disables per-site caps
+    long largeBytes = 0;          // 0 disables the large allocation lane
+    unsigned long seed = std::random_device()();
+  };
+
+  Reservoir() : Reservoir(Options()) {}
+  explicit Reservoir(Options options)
+      : options_(options), random_(options.seed) {}
+  Reservoir(const Reservoir &) = delete;
+  Reservoir &operator=(const Reservoir &) = delete;
+
+  // Takes effect right away on an empty reservoir, else on the next Clear
+  void Configure(Options options) {
+    if (empty()) {
+      Apply(options);
+    } else {
+      pending_ = options;
+    }
+  }
+
+  /**
+   * Adds a sample, possibly thinning it or an older one instead
+   *
+   * @param thinned called with every value leaving the reservoir
+   */
+  template <typename T> void Add(long site, V value, T &&thinned) {
+    if (options_.largeBytes > 0 && value.sizeBytes >= options_.largeBytes) {
+      samples_.insert({site, Kept{std::move(value), kLarge}});
+      return;
+    }
+    double priority = std::uniform_real_distribution<double>(0, 1)(random_);
+
+    // Kept samples stand for 1 / threshold, a sample above it would be
+    // counted that many times even where compaction left room
+    if (priority >= Threshold(site)) {
+      thinned_++;
+      thinned(value);
+      return;
+    }
+    if (Full(order_, options_.maxSamples) &&
+        priority >= order_.rbegin()->first) {
+      Thin(threshold_, priority);
+      thinned(value);
+      return;
+    }
+    if (options_.maxSamplesPerSite > 0) {
+      auto &entry = sites_[site];
+      if (Full(entry.order, options_.maxSamplesPerSite)) {
+        auto last = std::prev(entry.order.end());
+        if (priority >= last->first) {
+          Thin(entry.threshold, priority);
+          thinned(value);
+          return;
+        }
+        Thin(entry.threshold, last->first);
+        Evict(last->second, thinned);
+      }
+    }
+    if (Full(order_, options_.maxSamples)) {
+      auto last = std::prev(order_.end());
+      Thin(threshold_, last->first);
+      Evict(last->second, thinned);
+    }
+
+    auto sample = samples_.insert({site, Kept{std::move(value), priority}});
+    if (options_.maxSamples > 0)
+      order_.insert({priority, sample});
+    if (options_.maxSamplesPerSite > 0)
+      sites_[site].order.insert({priority, sample});
+  }
+
+  /**
+   * Visits samples grouped by site
+   *
+   * @param consumer called with (site, value, weight), weight being the
+   * number of sampled allocations the value stands for
+   */
+  template <typename C> void ForEach(C &&consumer) const {
+    for (auto const &[site, kept] : samples_) {
+      consumer(site, kept.value, Weight(site, kept));
+    }
+  }
+
+  /**
+   * Visits samples to update them in place
+   *
+   * @param visitor called with (site, value), must not change sizeBytes
+   */
+  template <typename F> void Update(F &&visitor) {
+    for (auto &[site, kept] : samples_) {
+      visitor(site, kept.value);
+    }
+  }
+
+  /**
+   * Removes samples, making room for new ones without thinning
+   *
+   * @param dead tells whether a value is to be removed
+   * @param fold called with (site, value, weight) of every removed value,
+   * weight being the one ForEach would have reported so far. Later samples
+   * are only taken below the thresholds, so weights stay unbiased.
+   * @return number of samples removed
+   */
+  template <typename D, typename F> size_t Compact(D &&dead, F &&fold) {
+    size_t removed = 0;
+    for (auto it = samples_.begin(); it != samples_.end();) {
+      auto &[site, kept] = *it;
+      if (!dead(kept.value)) {
+        ++it;
+        continue;
+      }
+      fold(site, kept.value, Weight(site, kept));
+      Erase(order_, it);
+      if (options_.maxSamplesPerSite > 0)
+        Erase(sites_[site].order, it);
+      it = samples_.erase(it);
+      removed++;
+    }
+    return removed;
+  }
+
+  size_t size() const { return samples_.size(); }
+  bool empty() const { return samples_.empty(); }
+  // Samples turned away or evicted since the last Clear
+  size_t Thinned() const { return thinned_; }
+
+  void Clear() {
+    samples_.clear();
+    order_.clear();
+    sites_.clear();
+    threshold_ = 1;
+    thinned_ = 0;
+    if (pending_) {
+      Apply(*pending_);
+      pending_.reset();
+    }
+  }
+
+private:
+  struct Kept {
+    V value;
+    double priority;
+  };
+  static constexpr double kLarge = -1; // priority of the large lane
+  using Samples = std::multimap<long, Kept>;
+  using Order = std::multimap<double, typename Samples::iterator>;
+  struct Site {
+    Order order;
+    double threshold = 1;
+  };
+
+  void Apply(Options options) {
+    options_ = options;
+    random_.seed(options.seed);
+    pending_.reset();
+  }
+
+  static bool Full(const Order &order, size_t max) {
+    return max > 0 && order.size() >= max;
+  }
+
+  void Thin(double &threshold, double priority) {
+    threshold = std::min(threshold, priority);
+    thinned_++;
+  }
+
+  static void Erase(Order &order, typename Samples::iterator sample) {
+    auto range = order.equal_range(sample->second.priority);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second == sample) {
+        order.erase(it);
+        return;
+      }
+    }
+  }
+
+  template <typename T>
+  void Evict(typename Samples::iterator sample, T &thinned) {
+    Erase(order_, sample);
+    if (options_.maxSamplesPerSite > 0)
+      Erase(sites_[sample->first].order, sample);
+    thinned(sample->second.value);
+    samples_.erase(sample);
+  }
+
+  double Threshold(long site) const {
+    auto threshold = threshold_;
+    auto it = sites_.find(site);
+    if (it != sites_.end())
+      threshold = std::min(threshold, it->second.threshold);
+    return threshold;
+  }
+
+  double Weight(long site, const Kept &kept) const {
+    if (kept.priority == kLarge)
+      return 1;
+    return 1 / Threshold(site);
+  }
+
+  Options options_;
+  std::optional<Options> pending_;
+  std::mt19937_64 random_;
+  Samples samples_;
+  Order order_; // samples that can be thinned, with maxSamples only
+  std::unordered_map<long, Site> sites_;
+  double threshold_ = 1;
+  size_t thinned_ = 0;
+};
+
+#endif // RESERVOIR_H_
@@ -0,0 +1,192 @@
+#include "gtest/gtest.h"
+#include "reservoir.h"
+
+#include <map>
+
+struct Value {
+    long sizeBytes;
+};
+
+static const unsigned long kSeed = 42;
+
+TEST(Reservoir, KeepsEverythingByDefault) {
+
+    Reservoir<Value> underTest;
+    for (int i = 0; i < 1000; i++) {
+        underTest.Add(i % 3, Value{16}, [](const Value &) { FAIL(); });
+    }
+    EXPECT_EQ(underTest.size(), 1000);
+    EXPECT_EQ(underTest.Thinned(), 0);
+
+    double total = 0;
+    underTest.ForEach([&total](long, const Value &, double weight) {
+        EXPECT_EQ(weight, 1);
+        total += weight;
+    });
+    EXPECT_EQ(total, 1000);
+}
+
+TEST(Reservoir, BoundsSamples) {
+
+    Reservoir<Value> underTest({.maxSamples = 1000, .seed = kSeed});
+    long thinned = 0;
+    for (int i = 0; i < 10000; i++) {
+        underTest.Add(i % 10, Value{16}, [&thinned](const Value &) { thinned++; });
+    }
+    EXPECT_EQ(underTest.size(), 1000);
+    EXPECT_EQ(underTest.Thinned(), 9000);
+    EXPECT_EQ(thinned, 9000);
+
+    // weights stand for the samples that were thinned
+    std::map<long, double> bySite;
+    long previous = -1;
+    underTest.ForEach([&](long site, const Value &, double weight) {
+        EXPECT_GE(site, previous); // grouped by site
+        previous = site;
+        bySite[site] += weight;
+    });
+    EXPECT_EQ(bySite.size(), 10);
+    for (auto const &[site, weight] : bySite) {
+        EXPECT_NEAR(weight, 1000, 250);
+    }
+}
+
+TEST(Reservoir, CapsSites) {
+
+    Reservoir<Value> underTest({.maxSamples = 1000, .maxSamplesPerSite = 100, .seed = kSeed});
+    for (int i = 0; i < 10000; i++) {
+        underTest.Add(1, Value{16}, [](const Value &) {});
+    }
+    for (int i = 0; i < 50; i++) {
+        underTest.Add(2, Value{16}, [](const Value &) {});
+    }
+
+    std::map<long, std::pair<long, double>> bySite;
+    underTest.ForEach([&bySite](long site, const Value &, double weight) {
+        bySite[site].first++;
+        bySite[site].second += weight;
+    });
+    EXPECT_EQ(bySite[1].first, 100);
+    EXPECT_NEAR(bySite[1].second, 10000, 2000);
+    // the rare site is not crowded out
+    EXPECT_EQ(bySite[2].first, 50);
+    EXPECT_EQ(bySite[2].second, 50);
+}
+
+TEST(Reservoir, NeverThinsLargeAllocations) {
+
+    Reservoir<Value> underTest({.maxSamples = 10, .largeBytes = 1024, .seed = kSeed});
+    for (int i = 0; i < 1000; i++) {
+        underTest.Add(1, Value{16}, [](const Value &value) { EXPECT_EQ(value.sizeBytes, 16); });
+        if (i % 10 == 0)
+            underTest.Add(2, Value{4096}, [](const Value &) { FAIL(); });
+    }
+
+    long large = 0;
+    underTest.ForEach([&large](long site, const Value &value, double weight) {
+        if (value.sizeBytes == 4096) {
+            EXPECT_EQ(weight, 1);
+            large++;
+        }
+    });
+    EXPECT_EQ(large, 100);
+    EXPECT_EQ(underTest.size(), 110);
+}
+
+TEST(Reservoir, Clear) {
+
+    Reservoir<Value> underTest({.maxSamples = 10, .seed = kSeed});
+    for (int i = 0; i < 100; i++) {
+        underTest.Add(1, Value{16}, [](const Value &) {});
+    }
+    underTest.Clear();
+
+    EXPECT_TRUE(underTest.empty());
+    EXPECT_EQ(underTest.Thinned(), 0);
+    underTest.Add(1, Value{16}, [](const Value &) {});
+    underTest.ForEach([](long, const Value &, double weight) { EXPECT_EQ(weight, 1); });
+}
+
+TEST(Reservoir, ConfigureAppliesFromNextWindow) {
+
+    Reservoir<Value> underTest({.maxSamples = 10, .seed = kSeed});
+    for (int i = 0; i < 5; i++) {
+        underTest.Add(1, Value{16}, [](const Value &) {});
+    }
+    underTest.Configure({.maxSamples = 2, .seed = kSeed});
+    for (int i = 0; i < 5; i++) {
+        underTest.Add(1, Value{16}, [](const Value &) {});
+    }
+    EXPECT_EQ(underTest.size(), 10);
+
+    underTest.Clear();
+    for (int i = 0; i < 5; i++) {
+        underTest.Add(1, Value{16}, [](const Value &) {});
+    }
+    EXPECT_EQ(underTest.size(), 2);
+}
+
+TEST(Reservoir, UpdatesInPlace) {
+
+    struct Tracked {
+        long sizeBytes;
+        bool inUse = false;
+    };
+    Reservoir<Tracked> underTest({.maxSamples = 10, .seed = kSeed});
+    for (int i = 0; i < 5; i++) {
+        underTest.Add(i, Tracked{16}, [](const Tracked &) {});
+    }
+    underTest.Update([](long site, Tracked &value) { value.inUse = site % 2 == 0; });
+
+    long inUse = 0;
+    underTest.ForEach([&inUse](long, const Tracked &value, double) { inUse += value.inUse; });
+    EXPECT_EQ(inUse, 3);
+}
+
+TEST(Reservoir, CompactsMakingRoom) {
+
+    Reservoir<Value> underTest({.maxSamples = 10, .maxSamplesPerSite = 6, .seed = kSeed});
+    for (int i = 0; i < 10; i++) {
+        underTest.Add(i % 2, Value{i % 2 == 0 ? 8 : 16}, [](const Value &) { FAIL(); });
+    }
+
+    std::map<long, double> folded;
+    auto removed = underTest.Compact(
+        [](const Value &value) { return value.sizeBytes == 8; },
+        [&folded](long site, const Value &, double weight) { folded[site] += weight; });
+    EXPECT_EQ(removed, 5);
+    EXPECT_EQ(folded[0], 5);
+    EXPECT_EQ(folded.count(1), 0);
+    EXPECT_EQ(underTest.size(), 5);
+
+    // freed room takes new samples without thinning
+    for (int i = 0; i < 5; i++) {
+        underTest.Add(0, Value{8}, [](const Value &) { FAIL(); });
+    }
+    EXPECT_EQ(underTest.size(), 10);
+    EXPECT_EQ(underTest.Thinned(), 0);
+
+    // once thinned, compacted weights and later ones add up to what was
+    // allocated
+    Reservoir<Value> thinning({.maxSamples = 100, .seed = kSeed});
+    for (int i = 0; i < 10000; i++) {
+        thinning.Add(0, Value{8}, [](const Value &) {});
+    }
+    double compacted = 0;
+    removed = thinning.Compact(
+        [](const Value &) { return true; },
+        [&compacted](long, const Value &, double weight) { compacted += weight; });
+    EXPECT_EQ(removed, 100);
+    EXPECT_NEAR(compacted, 10000, 2500);
+
+    // room left by compaction does not let samples past the threshold, each
+    // kept one stands for about 100
+    for (int i = 0; i < 1000; i++) {
+        thinning.Add(0, Value{16}, [](const Value &) {});
+    }
+    double kept = 0;
+    thinning.ForEach([&kept](long, const Value &, double weight) { kept += weight; });
+    EXPECT_LT(thinning.size(), 30);
+    EXPECT_NEAR(kept, 1000, 600);
+    EXPECT_NEAR(compacted + kept, 11000, 3000);
+}
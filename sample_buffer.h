@@ -0,0 +1,172 @@
+#ifndef SAMPLE_BUFFER_H_
+#define SAMPLE_BUFFER_H_
+
+// {{{ Includes
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+#include "slot_registry.h"
+#include "storage.h"
+//  }}}
+
+// {{{ Data
+struct Sample {
+  long stackId;
+  AllocationInfo info;
+};
+// }}}
+
+/**
+ * Append-only sample buffer owned by a single Java thread.
+ *
+ * Samples are written by the owning thread only and read by a single drainer
+ * (export), so neither side takes a lock: the writer publishes each slot with
+ * a release store of the chunk count, the drainer consumes up to an acquire
+ * load of it and recycles chunks the writer has already moved past. Recycled
+ * chunks are handed back to the writer through a spare list, so a buffer
+ * that is drained regularly stops allocating.
+ */
+class SampleBuffer : public SlotRegistry<SampleBuffer>::Entry {
+public:
+  static constexpr size_t kChunkSize = 512;
+  static constexpr size_t kMaxSpareChunks = 16;
+
+  SampleBuffer() : head_(new Chunk()), tail_(head_) {}
+  ~SampleBuffer() {
+    Free(head_);
+    Free(spare_.load());
+  }
+  SampleBuffer(const SampleBuffer &) = delete;
+  SampleBuffer &operator=(const SampleBuffer &) = delete;
+
+  // Writer side, owning thread only
+  void Push(Sample &&sample) {
+    auto count = tail_->count.load(std::memory_order_relaxed);
+    if (count == kChunkSize) {
+      auto chunk = SpareChunk();
+      tail_->next.store(chunk, std::memory_order_release);
+      tail_ = chunk;
+      count = 0;
+    }
+    tail_->samples[count] = std::move(sample);
+    tail_->count.store(count + 1, std::memory_order_release);
+  }
+
+  // Reader side, single drainer only
+  template <typename F> size_t Drain(F &&consumer) {
+    size_t drained = 0;
+    while (true) {
+      auto count = head_->count.load(std::memory_order_acquire);
+      for (; read_ < count; read_++, drained++) {
+        consumer(std::move(head_->samples[read_]));
+      }
+      auto next = head_->next.load(std::memory_order_acquire);
+      if (read_ < kChunkSize || next == nullptr) {
+        return drained;
+      }
+      Recycle(head_);
+      head_ = next;
+      read_ = 0;
+    }
+  }
+
+  size_t SpareChunks() const {
+    return spareCount_.load(std::memory_order_relaxed);
+  }
+
+  // Bytes of the chunks in use or spare
+  size_t MemoryBytes() const {
+    return chunks_.load(std::memory_order_relaxed) * sizeof(Chunk);
+  }
+
+private:
+  friend class SampleBuffers;
+
+  struct Chunk {
+    Sample samples[kChunkSize];
+    std::atomic<size_t> count = 0;
+    std::atomic<Chunk *> next = nullptr;
+  };
+
+  // Writer, the only thread popping spare chunks so there is no ABA
+  Chunk *SpareChunk() {
+    auto chunk = spare_.load(std::memory_order_acquire);
+    while (chunk != nullptr &&
+           !spare_.compare_exchange_weak(
+               chunk, chunk->next.load(std::memory_order_relaxed),
+               std::memory_order_acquire, std::memory_order_acquire)) {
+    }
+    if (chunk == nullptr) {
+      chunks_.fetch_add(1, std::memory_order_relaxed);
+      return new Chunk();
+    }
+    spareCount_.fetch_sub(1, std::memory_order_relaxed);
+    chunk->count.store(0, std::memory_order_relaxed);
+    chunk->next.store(nullptr, std::memory_order_relaxed);
+    return chunk;
+  }
+
+  // Drainer
+  void Recycle(Chunk *chunk) {
+    if (spareCount_.load(std::memory_order_relaxed) >= kMaxSpareChunks) {
+      chunks_.fetch_sub(1, std::memory_order_relaxed);
+      delete chunk;
+      return;
+    }
+    auto spare = spare_.load(std::memory_order_relaxed);
+    do {
+      chunk->next.store(spare, std::memory_order_relaxed);
+    } while (!spare_.compare_exchange_weak(spare, chunk,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed));
+    spareCount_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  static void Free(Chunk *chunk) {
+    while (chunk != nullptr) {
+      auto next = chunk->next.load(std::memory_order_relaxed);
+      delete chunk;
+      chunk = next;
+    }
+  }
+
+  Chunk *head_;             // drainer
+  size_t read_ = 0;         // drainer
+  Chunk *tail_;             // writer
+  std::atomic<Chunk *> spare_ = nullptr;
+  std::atomic<size_t> spareCount_ = 0;
+  std::atomic<size_t> chunks_ = 1;
+};
+
+/**
+ * Per-thread sample buffers. A buffer released by an exiting thread is
+ * drained as usual and later claimed by a new thread.
+ */
+class SampleBuffers {
+public:
+  SampleBuffer *Acquire() { return buffers_.Acquire(); }
+  void Release(SampleBuffer *buffer) { buffers_.Release(buffer); }
+
+  size_t MemoryBytes() const {
+    size_t bytes = 0;
+    buffers_.ForEach([&bytes](SampleBuffer &buffer) {
+      bytes += sizeof(SampleBuffer) + buffer.MemoryBytes();
+    });
+    return bytes;
+  }
+
+  // Single drainer only
+  template <typename F> size_t Drain(F &&consumer) {
+    size_t drained = 0;
+    buffers_.ForEach([&drained, &consumer](SampleBuffer &buffer) {
+      drained += buffer.Drain(consumer);
+    });
+    return drained;
+  }
+
+private:
+  SlotRegistry<SampleBuffer> buffers_;
+};
+
+#endif // SAMPLE_BUFFER_H_
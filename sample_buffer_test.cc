@@ -0,0 +1,66 @@
+#include "gtest/gtest.h"
+#include "sample_buffer.h"
+
+#include <thread>
+
+static Sample sampleFor(long stackId) {
+    return Sample{stackId, AllocationInfo{.sizeBytes = 16, .ref = 0}};
+}
+
+TEST(SampleBuffer, DrainAcrossChunks) {
+
+    SampleBuffer underTest;
+    const long count = SampleBuffer::kChunkSize * 2 + 3;
+    for (long i = 0; i < count; i++) {
+        underTest.Push(sampleFor(i));
+    }
+
+    long expected = 0;
+    auto drained = underTest.Drain([&](Sample &&sample) {
+        EXPECT_EQ(sample.stackId, expected++);
+        EXPECT_EQ(sample.info.sizeBytes, 16);
+    });
+
+    EXPECT_EQ(drained, count);
+    EXPECT_EQ(underTest.Drain([](Sample &&) {}), 0);
+
+    underTest.Push(sampleFor(count));
+    EXPECT_EQ(underTest.Drain([&](Sample &&sample) {
+        EXPECT_EQ(sample.stackId, count);
+    }), 1);
+}
+
+TEST(SampleBuffer, ConcurrentWriterAndDrainer) {
+
+    SampleBuffer underTest;
+    const long count = 100000;
+    std::thread writer([&] {
+        for (long i = 0; i < count; i++) {
+            underTest.Push(sampleFor(i));
+        }
+    });
+
+    long expected = 0;
+    while (expected < count) {
+        underTest.Drain([&](Sample &&sample) {
+            EXPECT_EQ(sample.stackId, expected++);
+        });
+    }
+    writer.join();
+    EXPECT_EQ(expected, count);
+}
+
+TEST(SampleBuffers, ReleasedBufferIsReused) {
+
+    SampleBuffers underTest;
+    auto first = underTest.Acquire();
+    auto second = underTest.Acquire();
+    EXPECT_NE(first, second);
+
+    first->Push(sampleFor(1));
+    underTest.Release(first);
+    EXPECT_EQ(underTest.Acquire(), first);
+
+    second->Push(sampleFor(2));
+    EXPECT_EQ(underTest.Drain([](Sample &&) {}), 2);
+}
@@ -0,0 +1,101 @@
+#ifndef SAMPLING_CONTROLLER_H_
+#define SAMPLING_CONTROLLER_H_
+
+// {{{ Includes
+#include <algorithm>
+#include <cstdint>
+
+#include "agent_stats.h"
+//  }}}
+
+/**
+ * Retunes the heap sampling interval to hold a sampling budget.
+ *
+ * Every tick the measured sample rate and share of CPU time spent in the
+ * callback are compared to their targets: going over either raises the
+ * interval by the overshoot, staying under half of both lowers it again,
+ * never below the configured interval. A callback p99 over the hard limit
+ * suspends sampling until the next Reset.
+ *
+ * Not thread-safe, driven by a single thread.
+ */
+class SamplingController {
+public:
+  struct Options {
+    long intervalBytes = 1024;     // floor of the interval
+    long maxSamplesPerSec = 0;     // 0 disables the rate target
+    long maxOverheadPermille = 0;  // of one CPU, 0 disables the target
+    long maxCallbackP99Micros = 0; // 0 disables the kill switch
+
+    bool Enabled() const {
+      return maxSamplesPerSec > 0 || maxOverheadPermille > 0 ||
+             maxCallbackP99Micros > 0;
+    }
+  };
+
+  static constexpr long kMaxIntervalBytes = 1L << 30;
+  // Largest change of the interval in a single tick
+  static constexpr double kMaxStep = 8;
+  // Fewer callbacks say nothing about the p99, cold ones symbolize methods
+  static constexpr uint64_t kMinCallbacksForP99 = 100;
+
+  explicit SamplingController(Options options) : options_(options) {
+    Reset();
+  }
+
+  bool Enabled() const { return options_.Enabled(); }
+
+  void Reset() {
+    interval_ = options_.intervalBytes;
+    suspended_ = false;
+  }
+
+  /**
+   * Feeds the callbacks measured since the previous tick
+   *
+   * @return the interval to sample at from now on
+   */
+  long Update(const HdrHistogram::Snapshot &callbacks,
+              uint64_t elapsedNanos) {
+    if (suspended_ || elapsedNanos == 0)
+      return interval_;
+    if (options_.maxCallbackP99Micros > 0 &&
+        callbacks.count >= kMinCallbacksForP99 &&
+        callbacks.Quantile(0.99) >
+            uint64_t(options_.maxCallbackP99Micros) * 1000) {
+      suspended_ = true;
+      return interval_;
+    }
+
+    double load = 0; // worst measured / target ratio
+    if (options_.maxSamplesPerSec > 0) {
+      double rate = callbacks.count * 1e9 / elapsedNanos;
+      load = std::max(load, rate / options_.maxSamplesPerSec);
+    }
+    if (options_.maxOverheadPermille > 0) {
+      double overhead = callbacks.nanos * 1e3 / elapsedNanos;
+      load = std::max(load, overhead / options_.maxOverheadPermille);
+    }
+
+    double interval = std::max(interval_, 1L);
+    if (load > 1) {
+      interval *= std::min(load, kMaxStep);
+    } else if (load < 0.5) {
+      // aim for three quarters of the budget
+      interval *= std::max(load / 0.75, 1 / kMaxStep);
+    }
+    interval_ = std::clamp(static_cast<long>(interval), options_.intervalBytes,
+                           std::max(kMaxIntervalBytes, options_.intervalBytes));
+    return interval_;
+  }
+
+  long Interval() const { return interval_; }
+  bool Suspended() const { return suspended_; }
+
+private:
+  const Options options_;
+  long interval_;
+  bool suspended_;
+};
+
+#endif // SAMPLING_CONTROLLER_H_
@@ -0,0 +1,66 @@
+#include "gtest/gtest.h"
+#include "sampling_controller.h"
+
+static const uint64_t kSecond = 1000000000;
+
+static HdrHistogram::Snapshot callbacks(uint64_t count, uint64_t nanos) {
+    HdrHistogram histogram;
+    for (uint64_t i = 0; i < count; i++) {
+        histogram.Record(nanos);
+    }
+    return histogram.Read();
+}
+
+TEST(SamplingController, DisabledByDefault) {
+
+    SamplingController underTest({.intervalBytes = 1024});
+    EXPECT_FALSE(underTest.Enabled());
+    EXPECT_EQ(underTest.Update(callbacks(100000, 100), kSecond), 1024);
+}
+
+TEST(SamplingController, HoldsSampleRate) {
+
+    SamplingController underTest({.intervalBytes = 1024, .maxSamplesPerSec = 500});
+    EXPECT_TRUE(underTest.Enabled());
+
+    // 4x over budget
+    EXPECT_EQ(underTest.Update(callbacks(2000, 100), kSecond), 4096);
+    // within budget, unchanged
+    EXPECT_EQ(underTest.Update(callbacks(400, 100), kSecond), 4096);
+    // allocation rate dropped, back towards three quarters of the budget
+    EXPECT_EQ(underTest.Update(callbacks(150, 100), kSecond), 1638);
+    // but never below the configured interval
+    EXPECT_EQ(underTest.Update(callbacks(0, 0), kSecond), 1024);
+}
+
+TEST(SamplingController, HoldsOverhead) {
+
+    SamplingController underTest({.intervalBytes = 1024, .maxOverheadPermille = 5});
+
+    // 1000 callbacks of 10us are 10ms per second, twice the budget
+    EXPECT_EQ(underTest.Update(callbacks(1000, 10000), kSecond), 2048);
+}
+
+TEST(SamplingController, StepIsBounded) {
+
+    SamplingController underTest({.intervalBytes = 1024, .maxSamplesPerSec = 1});
+
+    EXPECT_EQ(underTest.Update(callbacks(1000, 100), kSecond),
+              1024 * SamplingController::kMaxStep);
+}
+
+TEST(SamplingController, KillSwitch) {
+
+    SamplingController underTest({.intervalBytes = 1024, .maxCallbackP99Micros = 50});
+
+    // too few callbacks to judge
+    underTest.Update(callbacks(10, 1000000), kSecond);
+    EXPECT_FALSE(underTest.Suspended());
+
+    underTest.Update(callbacks(1000, 1000000), kSecond);
+    EXPECT_TRUE(underTest.Suspended());
+
+    underTest.Reset();
+    EXPECT_FALSE(underTest.Suspended());
+    EXPECT_EQ(underTest.Interval(), 1024);
+}
@@ -0,0 +1,74 @@
+#ifndef SLOT_REGISTRY_H_
+#define SLOT_REGISTRY_H_
+
+// {{{ Includes
+#include <atomic>
+//  }}}
+
+/**
+ * Lock-free registry of per-thread objects, each owned by one thread at a
+ * time.
+ *
+ * Entries are never unlinked: one released by an exiting thread keeps its
+ * state and is claimed by the next thread that needs one, so the list is
+ * bounded by the peak number of threads that held an entry concurrently.
+ * Entries derive from SlotRegistry<T>::Entry and are freed with the registry.
+ */
+template <typename T> class SlotRegistry {
+public:
+  class Entry {
+  private:
+    friend class SlotRegistry;
+    std::atomic_bool owned_ = true;
+    T *next_ = nullptr;
+  };
+
+  SlotRegistry() = default;
+  SlotRegistry(const SlotRegistry &) = delete;
+  SlotRegistry &operator=(const SlotRegistry &) = delete;
+  ~SlotRegistry() {
+    auto entry = head_.load(std::memory_order_acquire);
+    while (entry != nullptr) {
+      auto next = entry->next_;
+      delete entry;
+      entry = next;
+    }
+  }
+
+  // Claims a released entry, or a new one if every entry is owned
+  T *Acquire() {
+    auto head = head_.load(std::memory_order_acquire);
+    for (auto entry = head; entry != nullptr; entry = entry->next_) {
+      bool owned = false;
+      if (!entry->owned_.load(std::memory_order_relaxed) &&
+          entry->owned_.compare_exchange_strong(owned, true,
+                                                std::memory_order_acquire)) {
+        return entry;
+      }
+    }
+    auto entry = new T();
+    entry->next_ = head;
+    while (!head_.compare_exchange_weak(entry->next_, entry,
+                                        std::memory_order_release,
+                                        std::memory_order_relaxed)) {
+    }
+    return entry;
+  }
+
+  void Release(T *entry) {
+    entry->owned_.store(false, std::memory_order_release);
+  }
+
+  // Visits every entry, owned or not, safe with concurrent Acquire
+  template <typename F> void ForEach(F &&consumer) const {
+    auto entry = head_.load(std::memory_order_acquire);
+    for (; entry != nullptr; entry = entry->next_) {
+      consumer(*entry);
+    }
+  }
+
+private:
+  std::atomic<T *> head_ = nullptr;
+};
+
+#endif // SLOT_REGISTRY_H_
@@ -0,0 +1,56 @@
+#include "gtest/gtest.h"
+#include "slot_registry.h"
+
+#include <set>
+#include <thread>
+#include <vector>
+
+struct Counter : public SlotRegistry<Counter>::Entry {
+    long value = 0;
+};
+
+TEST(SlotRegistry, ReusesReleasedEntries) {
+
+    SlotRegistry<Counter> underTest;
+    auto first = underTest.Acquire();
+    auto second = underTest.Acquire();
+    EXPECT_NE(first, second);
+
+    first->value = 7;
+    underTest.Release(first);
+    auto reused = underTest.Acquire();
+    // a released entry keeps its state
+    EXPECT_EQ(reused, first);
+    EXPECT_EQ(reused->value, 7);
+
+    size_t entries = 0;
+    underTest.ForEach([&entries](Counter &) { entries++; });
+    EXPECT_EQ(entries, 2);
+}
+
+TEST(SlotRegistry, ConcurrentAcquire) {
+
+    SlotRegistry<Counter> underTest;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; t++) {
+        threads.emplace_back([&underTest] {
+            for (int i = 0; i < 1000; i++) {
+                auto entry = underTest.Acquire();
+                entry->value++;
+                underTest.Release(entry);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    long total = 0;
+    size_t entries = 0;
+    underTest.ForEach([&](Counter &counter) {
+        total += counter.value;
+        entries++;
+    });
+    EXPECT_EQ(total, 8000);
+    EXPECT_LE(entries, 8);
+}
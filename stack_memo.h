@@ -0,0 +1,61 @@
+#ifndef STACK_MEMO_H_
+#define STACK_MEMO_H_
+
+// {{{ Includes
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <jvmti.h>
+#include <vector>
+//  }}}
+
+/**
+ * Per-thread memo of the last few stacks a thread sampled and their ids.
+ *
+ * Tight allocation loops hit the sampler with the same stack over and over,
+ * a memo hit costs one memcmp instead of hashing the frames and looking up
+ * every method. Frame copies only grow to the deepest stack remembered, so a
+ * warm memo does not allocate.
+ */
+class StackMemo {
+public:
+  static constexpr size_t kEntries = 4;
+
+  // Returns 0 if the stack was not seen recently
+  uint64_t Find(const jvmtiFrameInfo *frames, size_t depth) const {
+    for (size_t i = 0; i < kEntries; i++) {
+      // most recently remembered first
+      auto &entry = entries_[(next_ + kEntries - 1 - i) % kEntries];
+      if (entry.id != 0 && entry.depth == depth &&
+          std::memcmp(entry.frames.data(), frames,
+                      depth * sizeof(jvmtiFrameInfo)) == 0)
+        return entry.id;
+    }
+    return 0;
+  }
+
+  void Remember(const jvmtiFrameInfo *frames, size_t depth, uint64_t id) {
+    auto &entry = entries_[next_];
+    entry.frames.assign(frames, frames + depth);
+    entry.depth = depth;
+    entry.id = id;
+    next_ = (next_ + 1) % kEntries;
+  }
+
+  void Clear() {
+    for (auto &entry : entries_) {
+      entry.id = 0;
+    }
+  }
+
+private:
+  struct Entry {
+    uint64_t id = 0;
+    size_t depth = 0;
+    std::vector<jvmtiFrameInfo> frames;
+  };
+  std::array<Entry, kEntries> entries_;
+  size_t next_ = 0;
+};
+
+#endif // STACK_MEMO_H_
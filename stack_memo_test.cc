@@ -0,0 +1,52 @@
+#include "gtest/gtest.h"
+#include "stack_memo.h"
+
+#include <vector>
+
+static std::vector<jvmtiFrameInfo> stackOf(std::initializer_list<long> methods) {
+    std::vector<jvmtiFrameInfo> frames;
+    for (auto method : methods) {
+        frames.push_back({reinterpret_cast<jmethodID>(method), 0});
+    }
+    return frames;
+}
+
+TEST(StackMemo, FindsRememberedStack) {
+
+    StackMemo underTest;
+    auto stack = stackOf({2, 1});
+    EXPECT_EQ(underTest.Find(stack.data(), stack.size()), 0);
+
+    underTest.Remember(stack.data(), stack.size(), 42);
+    EXPECT_EQ(underTest.Find(stack.data(), stack.size()), 42);
+
+    // a prefix or a different location is another stack
+    EXPECT_EQ(underTest.Find(stack.data(), 1), 0);
+    stack[0].location = 7;
+    EXPECT_EQ(underTest.Find(stack.data(), stack.size()), 0);
+}
+
+TEST(StackMemo, EvictsOldestStack) {
+
+    StackMemo underTest;
+    std::vector<std::vector<jvmtiFrameInfo>> stacks;
+    for (long i = 1; i <= StackMemo::kEntries + 1; i++) {
+        stacks.push_back(stackOf({i, 100}));
+        underTest.Remember(stacks.back().data(), 2, i);
+    }
+
+    EXPECT_EQ(underTest.Find(stacks[0].data(), 2), 0);
+    for (long i = 1; i <= StackMemo::kEntries; i++) {
+        EXPECT_EQ(underTest.Find(stacks[i].data(), 2), i + 1);
+    }
+}
+
+TEST(StackMemo, Clear) {
+
+    StackMemo underTest;
+    auto stack = stackOf({2, 1});
+    underTest.Remember(stack.data(), stack.size(), 42);
+    underTest.Clear();
+
+    EXPECT_EQ(underTest.Find(stack.data(), stack.size()), 0);
+}
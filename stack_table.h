@@ -0,0 +1,292 @@
+#ifndef STACK_TABLE_H_
+#define STACK_TABLE_H_
+
+// {{{ Includes
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <jvmti.h>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "concurrent_map.h"
+//  }}}
+
+// {{{ Data
+struct Frame {
+  uintptr_t method;
+  jlocation location;
+};
+
+// Method of the frame ending a stack cut at max_frames, never a jmethodID
+constexpr uintptr_t kTruncatedMethod = 1;
+// Method of the bottom frame holding the label set id of a sample as its
+// location, never a jmethodID
+constexpr uintptr_t kLabelsMethod = 2;
+
+inline uintptr_t MethodOf(const Frame &frame) { return frame.method; }
+inline uintptr_t MethodOf(const jvmtiFrameInfo &frame) {
+  return reinterpret_cast<uintptr_t>(frame.method);
+}
+
+class StackTrace {
+public:
+  // TODO: expose necessary iterator instead of vector
+  std::vector<Frame> GetFrames() const { return frames; }
+  void AddFrame(uintptr_t methodId, jlocation location) {
+    frames.push_back({methodId, location});
+  };
+
+private:
+  std::vector<Frame> frames;
+};
+
+inline std::ostream &operator<<(std::ostream &os, const StackTrace &st) {
+  std::stringstream sstream;
+  for (auto frame : st.GetFrames()) {
+    sstream << std::hex << frame.method << "@" << frame.location << " ";
+  }
+  return (os << sstream.str());
+}
+// }}}
+
+// 64x64->128 bit multiply folded to 64 bits, as in wyhash
+inline uint64_t HashMix(uint64_t a, uint64_t b) {
+  __uint128_t r = static_cast<__uint128_t>(a) * b;
+  return static_cast<uint64_t>(r) ^ static_cast<uint64_t>(r >> 64);
+}
+
+/**
+ * Interns a value under a non-zero id derived from its hash and returns the
+ * id. A value colliding with an already interned one probes the next id
+ * derived with seed, so equal values get the same id and different ones
+ * never share one.
+ *
+ * @param make creates the value to store, only called for an unused id
+ * @param equals tells whether a stored value is the one interned
+ */
+template <typename V, typename M, typename E>
+uint64_t InternByHash(ConcurrentMap<V> &map, uint64_t hash, uint64_t seed,
+                      M &&make, E &&equals) {
+  for (uint64_t attempt = 0;; attempt++) {
+    auto id = attempt == 0 ? hash : HashMix(hash ^ attempt, seed);
+    id = id == 0 ? 1 : id;
+    auto value = map.Find(id);
+    if (value == nullptr) {
+      if (map.Insert(id, make()))
+        return id;
+      // Lost the race, wait until the winner has published its value
+      while ((value = map.Find(id)) == nullptr)
+        std::this_thread::yield();
+    }
+    if (equals(*value))
+      return id;
+  }
+}
+
+/**
+ * Interning table for stack traces.
+ *
+ * Equal stacks always get the same non-zero id and different stacks never
+ * share one: ids are derived from a 64-bit hash of the frames, and a stack
+ * colliding with an already interned one probes the next derived id after
+ * its frames were compared. Frames of all stacks are stored back to back in
+ * a chunked arena, each frame as a zigzag varint delta to the previous
+ * method followed by the zigzag varint location.
+ *
+ * Intern and Get are lock-free and safe to call from any thread, only
+ * allocating a new arena chunk takes a lock.
+ */
+class StackTable {
+public:
+  static constexpr size_t kChunkSize = 64 * 1024;
+
+  StackTable() { NewChunk(kChunkSize); }
+
+  template <typename F> uint64_t Intern(const F *frames, size_t depth) {
+    return InternByHash(
+        stacks_, Hash(frames, depth), kSeed,
+        [this, frames, depth] { return Store(frames, depth); },
+        [frames, depth](const Stack &stack) {
+          return Equals(stack, frames, depth);
+        });
+  }
+
+  StackTrace Get(uint64_t id) const {
+    StackTrace stackTrace;
+    auto stack = stacks_.Find(id);
+    if (stack == nullptr)
+      return stackTrace;
+    Decode(*stack, [&stackTrace](uintptr_t method, jlocation location) {
+      stackTrace.AddFrame(method, location);
+      return true;
+    });
+    return stackTrace;
+  }
+
+  // Stores frames under the id another table gave them, requires no
+  // concurrent users
+  template <typename F>
+  void Adopt(uint64_t id, const F *frames, size_t depth) {
+    stacks_.Insert(id, Store(frames, depth));
+  }
+
+  // Visits every stack with its id, safe with concurrent interning
+  template <typename C> void ForEach(C &&consumer) const {
+    stacks_.ForEach([&consumer](uint64_t id, const Stack &stack) {
+      StackTrace stackTrace;
+      Decode(stack, [&stackTrace](uintptr_t method, jlocation location) {
+        stackTrace.AddFrame(method, location);
+        return true;
+      });
+      consumer(id, stackTrace);
+    });
+  }
+
+  size_t size() const { return stacks_.size(); }
+
+  // Bytes reserved for encoded frames
+  size_t ArenaBytes() const {
+    return arenaBytes_.load(std::memory_order_relaxed);
+  }
+
+  // Requires no concurrent readers or writers
+  void Clear() {
+    stacks_.Clear();
+    chunks_.clear();
+    arenaBytes_.store(0);
+    NewChunk(kChunkSize);
+  }
+
+private:
+  static constexpr uint64_t kSeed = 0xa0761d6478bd642fULL;
+
+  struct Stack {
+    const uint8_t *data;
+    uint32_t bytes;
+    uint32_t depth;
+  };
+
+  struct Chunk {
+    explicit Chunk(size_t capacity)
+        : capacity(capacity), data(new uint8_t[capacity]) {}
+    const size_t capacity;
+    std::unique_ptr<uint8_t[]> data;
+    std::atomic<size_t> used = 0;
+  };
+
+  template <typename F> static uint64_t Hash(const F *frames, size_t depth) {
+    uint64_t hash = HashMix(depth, kSeed);
+    for (size_t i = 0; i < depth; i++) {
+      hash = HashMix(hash ^ MethodOf(frames[i]), 0xe7037ed1a0b428dbULL);
+      hash = HashMix(hash ^ frames[i].location, 0x8ebc6af09c88c6e3ULL);
+    }
+    return hash;
+  }
+
+  static uint64_t ZigZag(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ (value >> 63);
+  }
+  static int64_t UnZigZag(uint64_t value) {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+  }
+  static size_t VarintSize(uint64_t value) {
+    size_t size = 1;
+    for (; value >= 0x80; value >>= 7)
+      size++;
+    return size;
+  }
+  static uint8_t *PutVarint(uint8_t *out, uint64_t value) {
+    for (; value >= 0x80; value >>= 7)
+      *out++ = static_cast<uint8_t>(value | 0x80);
+    *out++ = static_cast<uint8_t>(value);
+    return out;
+  }
+  static const uint8_t *GetVarint(const uint8_t *in, uint64_t &value) {
+    value = 0;
+    for (int shift = 0;; shift += 7) {
+      uint8_t byte = *in++;
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if (byte < 0x80)
+        return in;
+    }
+  }
+
+  // Calls consumer(method, location) per frame until it returns false
+  template <typename C>
+  static bool Decode(const Stack &stack, C &&consumer) {
+    const uint8_t *in = stack.data;
+    uintptr_t method = 0;
+    for (uint32_t i = 0; i < stack.depth; i++) {
+      uint64_t delta, location;
+      in = GetVarint(in, delta);
+      in = GetVarint(in, location);
+      method += UnZigZag(delta);
+      if (!consumer(method, static_cast<jlocation>(UnZigZag(location))))
+        return false;
+    }
+    return true;
+  }
+
+  template <typename F>
+  static bool Equals(const Stack &stack, const F *frames, size_t depth) {
+    if (stack.depth != depth)
+      return false;
+    size_t i = 0;
+    return Decode(stack, [frames, &i](uintptr_t method, jlocation location) {
+      auto &frame = frames[i++];
+      return method == MethodOf(frame) && location == frame.location;
+    });
+  }
+
+  template <typename F> Stack Store(const F *frames, size_t depth) {
+    size_t bytes = 0;
+    uintptr_t previous = 0;
+    for (size_t i = 0; i < depth; i++) {
+      bytes += VarintSize(ZigZag(MethodOf(frames[i]) - previous));
+      bytes += VarintSize(ZigZag(frames[i].location));
+      previous = MethodOf(frames[i]);
+    }
+    auto data = Allocate(bytes);
+    auto out = data;
+    previous = 0;
+    for (size_t i = 0; i < depth; i++) {
+      out = PutVarint(out, ZigZag(MethodOf(frames[i]) - previous));
+      out = PutVarint(out, ZigZag(frames[i].location));
+      previous = MethodOf(frames[i]);
+    }
+    return Stack{data, static_cast<uint32_t>(bytes),
+                 static_cast<uint32_t>(depth)};
+  }
+
+  uint8_t *Allocate(size_t bytes) {
+    while (true) {
+      auto chunk = current_.load(std::memory_order_acquire);
+      auto offset = chunk->used.fetch_add(bytes, std::memory_order_relaxed);
+      if (offset + bytes <= chunk->capacity)
+        return chunk->data.get() + offset;
+      const std::lock_guard<std::mutex> lock(chunks_lock_);
+      if (current_.load(std::memory_order_relaxed) == chunk)
+        NewChunk(std::max(bytes, kChunkSize));
+    }
+  }
+
+  // Requires chunks_lock_ unless called before the table is shared
+  void NewChunk(size_t capacity) {
+    chunks_.push_back(std::make_unique<Chunk>(capacity));
+    arenaBytes_.fetch_add(capacity, std::memory_order_relaxed);
+    current_.store(chunks_.back().get(), std::memory_order_release);
+  }
+
+  ConcurrentMap<Stack> stacks_;
+  std::vector<std::unique_ptr<Chunk>> chunks_;
+  std::atomic<Chunk *> current_ = nullptr;
+  std::atomic<size_t> arenaBytes_ = 0;
+  std::mutex chunks_lock_;
+};
+
+#endif // STACK_TABLE_H_
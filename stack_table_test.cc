@@ -0,0 +1,104 @@
+#include "gtest/gtest.h"
+#include "stack_table.h"
+
+#include <thread>
+#include <vector>
+
+static std::vector<Frame> framesOf(std::initializer_list<uintptr_t> methods) {
+    std::vector<Frame> frames;
+    jlocation location = 0;
+    for (auto method : methods) {
+        frames.push_back({method, location++});
+    }
+    return frames;
+}
+
+TEST(StackTable, InternEqualStacks) {
+
+    StackTable underTest;
+    auto frames = framesOf({0x7f0000001000, 0x7f0000000ff8, 0x7f0000002000});
+    auto id = underTest.Intern(frames.data(), frames.size());
+    EXPECT_NE(id, 0);
+    EXPECT_EQ(underTest.Intern(frames.data(), frames.size()), id);
+    EXPECT_EQ(underTest.size(), 1);
+
+    auto decoded = underTest.Get(id).GetFrames();
+    ASSERT_EQ(decoded.size(), frames.size());
+    for (size_t i = 0; i < frames.size(); i++) {
+        EXPECT_EQ(decoded[i].method, frames[i].method);
+        EXPECT_EQ(decoded[i].location, frames[i].location);
+    }
+}
+
+TEST(StackTable, DifferentStacksGetDifferentIds) {
+
+    StackTable underTest;
+    auto a = framesOf({1, 2, 3});
+    auto b = framesOf({1, 2});
+    auto c = framesOf({1, 2, 3});
+    c[2].location = -1; // native frame
+
+    auto idA = underTest.Intern(a.data(), a.size());
+    auto idB = underTest.Intern(b.data(), b.size());
+    auto idC = underTest.Intern(c.data(), c.size());
+    EXPECT_NE(idA, idB);
+    EXPECT_NE(idA, idC);
+    EXPECT_EQ(underTest.Get(idC).GetFrames()[2].location, -1);
+    EXPECT_EQ(underTest.size(), 3);
+}
+
+TEST(StackTable, InternJvmtiFrames) {
+
+    StackTable underTest;
+    jvmtiFrameInfo jvmtiFrames[] = {{reinterpret_cast<jmethodID>(8), 3},
+                                    {reinterpret_cast<jmethodID>(16), 7}};
+    auto frames = std::vector<Frame>{{8, 3}, {16, 7}};
+    EXPECT_EQ(underTest.Intern(jvmtiFrames, 2),
+              underTest.Intern(frames.data(), frames.size()));
+}
+
+TEST(StackTable, ConcurrentIntern) {
+
+    StackTable underTest;
+    const int stacks = 2000;
+    std::vector<std::vector<uint64_t>> ids(4, std::vector<uint64_t>(stacks));
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&underTest, &ids, t] {
+            for (int i = 0; i < stacks; i++) {
+                auto frames = framesOf({uintptr_t(i + 1), uintptr_t(i % 7 + 1)});
+                ids[t][i] = underTest.Intern(frames.data(), frames.size());
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(underTest.size(), stacks);
+    for (int t = 1; t < 4; t++) {
+        EXPECT_EQ(ids[t], ids[0]);
+    }
+}
+
+TEST(StackTable, Clear) {
+
+    StackTable underTest;
+    auto frames = framesOf({1});
+    auto id = underTest.Intern(frames.data(), frames.size());
+    underTest.Clear();
+    EXPECT_EQ(underTest.size(), 0);
+    EXPECT_EQ(underTest.Get(id).GetFrames().size(), 0);
+}
+
+TEST(StackTable, AdoptKeepsId) {
+
+    StackTable previous;
+    auto frames = framesOf({0x7f0000001000, 0x7f0000002000});
+    auto id = previous.Intern(frames.data(), frames.size());
+
+    StackTable underTest;
+    underTest.Adopt(id, frames.data(), frames.size());
+    EXPECT_EQ(underTest.Get(id).GetFrames().size(), 2);
+    EXPECT_EQ(underTest.Intern(frames.data(), frames.size()), id);
+    EXPECT_EQ(underTest.size(), 1);
+}
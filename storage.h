@@ -6,76 +6,377 @@
 #include <cstdlib>
 #include <iostream>
 #include <jvmti.h>
+#include <memory>
 
 #include <fstream>
 #include <map>
 #include <sstream>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
+
+#include "call_tree.h"
+#include "concurrent_map.h"
+#include "epochs.h"
+#include "label_sets.h"
+#include "lifetimes.h"
+#include "reservoir.h"
+#include "stack_table.h"
+#include "upscaling.h"
 //  }}}
 
 // {{{ Data
 struct AllocationInfo {
   long sizeBytes;
+  // Weak global ref of the object, or its tag with tag_liveness
   uintptr_t ref;
+  // Sampling interval in effect when the allocation was sampled
+  long intervalBytes = 0;
+  // Wall clock nanoseconds and garbage collections finished at allocation
+  long timeNanos = 0;
+  long gcEpoch = 0;
+  // Last garbage collection the object was seen to survive, 0 if none
+  long survivedEpoch = 0;
+  // When the object was seen dead, 0 while alive or not looked at yet
+  long deathNanos = 0;
 };
 
-struct MethodInfo {
-  std::string name;
-  std::string klass;
-  std::string file;
-  int line;
-};
+// Estimates of the sampled allocations of a site
+struct SiteEstimate {
+  Estimate alloc;
+  Estimate used;
+  double byteNanos = 0; // footprint
+  Lifetimes lifetimes;  // of dead objects
 
-inline std::ostream &operator<<(std::ostream &os, const MethodInfo &m) {
-  return (os << m.klass << m.name << "(" << m.file << ":" << m.line << ")");
-}
+  /**
+   * Adds a sample standing for retained samples
+   *
+   * @param asOfNanos objects in use count towards footprint until then
+   */
+  void Add(const AllocationInfo &info, double retained, bool inUse,
+           long asOfNanos) {
+    alloc.Add(info.sizeBytes, info.intervalBytes, retained);
+    if (inUse)
+      used.Add(info.sizeBytes, info.intervalBytes, retained);
+    auto end = info.deathNanos > 0 ? info.deathNanos : inUse ? asOfNanos : 0;
+    if (info.timeNanos <= 0 || end <= info.timeNanos)
+      return;
+    auto weight =
+        Estimate::Weight(info.sizeBytes, info.intervalBytes) * retained;
+    double lifetime = end - info.timeNanos;
+    byteNanos += weight * info.sizeBytes * lifetime;
+    if (info.deathNanos > 0) {
+      auto gcs =
+          info.survivedEpoch > 0 ? info.survivedEpoch - info.gcEpoch : 0;
+      lifetimes.Add(lifetime, gcs, weight);
+    }
+  }
+};
 
-class StackTrace {
+// Compact copy of a JVMTI line number table, sorted by start location
+class LineTable {
 public:
-  // TODO: expose necessary iterator instead of vector
-  std::vector<uintptr_t> GetFrames() const { return frames; }
-  void AddFrame(uintptr_t methodId) { frames.push_back(methodId); };
+  LineTable() = default;
+  LineTable(const jvmtiLineNumberEntry *table, jint count) {
+    entries.reserve(count);
+    for (jint i = 0; i < count; i++) {
+      entries.push_back({static_cast<uint32_t>(table[i].start_location),
+                         table[i].line_number});
+    }
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry &a, const Entry &b) { return a.start < b.start; });
+  }
+  // Zero for native methods and methods without line information
+  int LineOf(jlocation location) const {
+    if (entries.empty())
+      return 0;
+    auto entry = std::upper_bound(
+        entries.begin(), entries.end(), location,
+        [](jlocation location, const Entry &e) { return location < e.start; });
+    return entry == entries.begin() ? entry->line : (entry - 1)->line;
+  }
+  size_t size() const { return entries.size(); }
 
 private:
-  std::vector<uintptr_t> frames;
+  struct Entry {
+    uint32_t start; // bytecode index
+    int32_t line;
+  };
+  std::vector<Entry> entries;
 };
 
-inline std::ostream &operator<<(std::ostream &os, const StackTrace &st) {
-  std::stringstream sstream;
-  for (auto id : st.GetFrames()) {
-    sstream << std::hex << id << " ";
-  }
-  return (os << sstream.str());
+// Shared by all methods of a class
+struct ClassInfo {
+  std::string signature;
+  std::string file;
+};
+
+inline std::ostream &operator<<(std::ostream &os, const ClassInfo &c) {
+  return (os << c.signature << "(" << c.file << ")");
 }
 
+struct MethodInfo {
+  std::string name;
+  uintptr_t klass; // id of the declaring ClassInfo
+  LineTable lines;
+};
+
+inline std::ostream &operator<<(std::ostream &os, const MethodInfo &m) {
+  return (os << m.name << "[" << std::hex << m.klass << std::dec << "]");
+}
+
+/**
+ * What was sampled, and the stacks, methods, classes, label sets and call
+ * paths it refers to.
+ *
+ * Interned data is kept in generations so that it does not grow for the
+ * life of the process: Rotate starts a new one at the end of every window,
+ * the one before becomes the previous generation and older ones are freed.
+ * Sampling threads use the current and the previous generation without the
+ * storage lock: they announce themselves in epochs first, a generation is
+ * only freed once no thread announced could still reach it. Ids stay the
+ * same across generations, lookups under the storage lock search them all.
+ */
 class Storage {
 public:
-  // TODO: hide fields and expose necessary iterators
-  std::multimap<long, AllocationInfo> allocations;
-  std::unordered_map<uintptr_t, MethodInfo> methods;
+  // Sampled allocations of the current window by stack id, requires the
+  // storage lock
+  Reservoir<AllocationInfo> allocations;
+  // Tags of sampled objects not freed yet, with tag_liveness, requires the
+  // storage lock
+  std::unordered_set<uintptr_t> liveObjects;
+  // Dead samples of the current window compacted out of allocations, by
+  // stack id, requires the storage lock
+  std::unordered_map<long, SiteEstimate> folded;
+  // Announced by threads using generations without the storage lock
+  Epochs epochs;
+
+  Storage() { Publish(std::make_unique<Generation>()); }
+  Storage(const Storage &) = delete;
+  Storage &operator=(const Storage &) = delete;
+
   void AddMethod(uintptr_t id, MethodInfo methodInfo) {
-    methods.insert({id, methodInfo});
+    Current().methods.Insert(id, std::move(methodInfo));
+  }
+  void AddClass(uintptr_t id, ClassInfo classInfo) {
+    Current().classes.Insert(id, std::move(classInfo));
+  }
+  // Interns the stack, safe to use without the storage lock
+  template <typename F> long AddStackTrace(const F *frames, size_t depth) {
+    return Current().stacks.Intern(frames, depth);
+  }
+  long AddStackTrace(const StackTrace &stackTrace) {
+    auto frames = stackTrace.GetFrames();
+    return AddStackTrace(frames.data(), frames.size());
+  }
+  void AddAllocation(long stackId, AllocationInfo allocationInfo) {
+    AddAllocation(stackId, allocationInfo, [](const AllocationInfo &) {});
+  }
+  // thinned is called with allocations the reservoir let go of
+  template <typename T>
+  void AddAllocation(long stackId, AllocationInfo allocationInfo,
+                     T &&thinned) {
+    allocations.Add(stackId, allocationInfo, thinned);
+  }
+  // Interns context labels, safe to use without the storage lock
+  uint64_t AddLabels(const Labels &labels) {
+    return Current().labels.Intern(labels);
+  }
+  // Call paths sampled into, safe to use without the storage lock
+  CallTree &Calls() { return Current().calls; }
+
+  // Wait-free lookups of the current generation, safe to use without the
+  // storage lock
+  bool HasMethod(uintptr_t id) const {
+    return Current().methods.Find(id) != nullptr;
+  }
+  bool HasClass(uintptr_t id) const {
+    return Current().classes.Find(id) != nullptr;
   }
-  void AddAllocation(long id, StackTrace stackTrace,
-                     AllocationInfo allocationInfo) {
-    if (stacks.count(id) == 0) {
-      stacks.insert({id, stackTrace});
+
+  // Lookups of any generation, require the storage lock
+  const MethodInfo &GetMethod(uintptr_t id) const {
+    static const MethodInfo unknown{.name = "Unknown", .klass = 0};
+    auto method = Find(&Generation::methods, id);
+    return method != nullptr ? *method : unknown;
+  }
+  const ClassInfo &GetClass(uintptr_t id) const {
+    static const ClassInfo unknown{.signature = "", .file = "Unknown"};
+    auto klass = Find(&Generation::classes, id);
+    return klass != nullptr ? *klass : unknown;
+  }
+  StackTrace GetStackTrace(long id) const {
+    for (auto const &generation : generations_) {
+      auto stackTrace = generation->stacks.Get(id);
+      if (!stackTrace.GetFrames().empty())
+        return stackTrace;
+    }
+    return StackTrace();
+  }
+  // Returns nullptr for 0 or an unknown id
+  const Labels *GetLabels(uint64_t id) const {
+    for (auto const &generation : generations_) {
+      auto labels = generation->labels.Get(id);
+      if (labels != nullptr)
+        return labels;
+    }
+    return nullptr;
+  }
+  // Every method once, from the newest generation having it
+  template <typename C> void ForEachMethod(C &&consumer) const {
+    std::unordered_set<uintptr_t> seen;
+    for (auto const &generation : generations_) {
+      generation->methods.ForEach(
+          [&seen, &consumer](uintptr_t id, const MethodInfo &method) {
+            if (seen.insert(id).second)
+              consumer(id, method);
+          });
+    }
+  }
+  // Call trees of every generation, oldest first
+  template <typename C> void ForEachCallTree(C &&consumer) {
+    for (auto it = generations_.rbegin(); it != generations_.rend(); ++it) {
+      consumer((*it)->calls);
+    }
+  }
+
+  /**
+   * Starts a new generation, requires the storage lock. Samples of the
+   * window ending now must have been exported, older generations are freed
+   * by Reclaim. Methods of the stacks and call paths sampled in the window
+   * are carried over with their classes, so sampling them again needs no
+   * symbolization; their stacks are interned again on their first sample.
+   *
+   * @param keep stack ids still referred to, carried over with their
+   * methods, classes and label sets
+   */
+  void Rotate(const std::vector<long> &keep = {}) {
+    auto next = std::make_unique<Generation>();
+    for (auto id : keep) {
+      Carry(*next, id);
+    }
+    auto &current = Current();
+    current.stacks.ForEach([this, &next](uint64_t, const StackTrace &stack) {
+      for (auto const &frame : stack.GetFrames()) {
+        if (frame.method != kLabelsMethod)
+          CarryMethod(*next, frame.method);
+      }
+    });
+    current.calls.ForEachFrame(
+        [this, &next](const Frame &frame) { CarryMethod(*next, frame.method); });
+    auto &generation = *next;
+    Publish(std::move(next));
+    generation.epoch = epochs.Advance();
+  }
+
+  /**
+   * Frees generations no thread can reach anymore, requires the storage
+   * lock. A thread announced since a generation became current only reaches
+   * it and the one before it, older ones are freed once no thread is
+   * announced in an earlier epoch. Epochs advance for other reasons too.
+   */
+  void Reclaim() {
+    while (generations_.size() > 2 &&
+           epochs.Quiescent(generations_[generations_.size() - 3]->epoch)) {
+      generations_.pop_back();
+    }
+  }
+
+  size_t Generations() const { return generations_.size(); }
+  size_t CallPaths() const {
+    size_t paths = 0;
+    for (auto const &generation : generations_) {
+      paths += generation->calls.size();
     }
-    allocations.insert({id, allocationInfo});
+    return paths;
   }
-  bool HasMethod(uintptr_t id) const { return methods.count(id) != 0; }
-  MethodInfo GetMethod(uintptr_t id) { return methods[id]; }
-  StackTrace GetStackTrace(long id) { return stacks[id]; }
-  void Clear() {
-    stacks.clear();
-    methods.clear();
-    allocations.clear();
+
+  // Approximate bytes held, without what strings and containers own,
+  // requires the storage lock
+  size_t MemoryBytes() const {
+    size_t bytes = allocations.size() * sizeof(AllocationInfo) +
+                   liveObjects.size() * (sizeof(uintptr_t) + sizeof(void *)) +
+                   folded.size() * (sizeof(long) + sizeof(SiteEstimate));
+    for (auto const &generation : generations_) {
+      bytes += generation->stacks.ArenaBytes() +
+               generation->methods.size() * sizeof(MethodInfo) +
+               generation->classes.size() * sizeof(ClassInfo) +
+               generation->labels.size() * sizeof(Labels) +
+               generation->calls.MemoryBytes();
+    }
+    return bytes;
+  }
+  // Keeps interned stacks, resolved methods and classes, they stay valid
+  // until the generation is rotated out
+  void ClearAllocations() {
+    allocations.Clear();
+    folded.clear();
   }
 
 private:
-  std::unordered_map<long, StackTrace> stacks;
+  struct Generation {
+    uint64_t epoch = 0; // the generation is current from then on
+    StackTable stacks;
+    ConcurrentMap<MethodInfo> methods;
+    ConcurrentMap<ClassInfo> classes;
+    LabelSets labels;
+    CallTree calls;
+  };
+
+  Generation &Current() const {
+    return *current_.load(std::memory_order_acquire);
+  }
+
+  void Publish(std::unique_ptr<Generation> generation) {
+    current_.store(generation.get(), std::memory_order_release);
+    generations_.insert(generations_.begin(), std::move(generation));
+  }
+
+  template <typename V>
+  const V *Find(ConcurrentMap<V> Generation::*map, uintptr_t id) const {
+    for (auto const &generation : generations_) {
+      auto found = ((*generation).*map).Find(id);
+      if (found != nullptr)
+        return found;
+    }
+    return nullptr;
+  }
+
+  // Copies a stack and what it refers to into a generation not published
+  // yet
+  void Carry(Generation &next, long id) {
+    auto frames = GetStackTrace(id).GetFrames();
+    if (frames.empty())
+      return;
+    next.stacks.Adopt(id, frames.data(), frames.size());
+    for (auto const &frame : frames) {
+      if (frame.method == kLabelsMethod) {
+        auto labels = GetLabels(frame.location);
+        if (labels != nullptr)
+          next.labels.Adopt(frame.location, *labels);
+        continue;
+      }
+      CarryMethod(next, frame.method);
+    }
+  }
+
+  // Copies a method and its class into a generation not published yet
+  void CarryMethod(Generation &next, uintptr_t id) {
+    if (next.methods.Find(id) != nullptr)
+      return;
+    auto method = Find(&Generation::methods, id);
+    if (method == nullptr)
+      return;
+    next.methods.Insert(id, *method);
+    auto klass = Find(&Generation::classes, method->klass);
+    if (klass != nullptr)
+      next.classes.Insert(method->klass, *klass);
+  }
+
+  // Newest first, changed under the storage lock only
+  std::vector<std::unique_ptr<Generation>> generations_;
+  std::atomic<Generation *> current_ = nullptr;
 };
 
 // }}}
@@ -2,8 +2,9 @@
 #include "storage.h"
 
 
-static MethodInfo methodInfo1 {.file = "file1", .klass = "klass1", .line = 1, .name = "method1"};
-static MethodInfo methodInfo2 {.file = "file2", .klass = "klass2", .line = 2, .name = "method2"};
+static ClassInfo classInfo1 {.signature = "klass1", .file = "file1"};
+static MethodInfo methodInfo1 {.name = "method1", .klass = 1};
+static MethodInfo methodInfo2 {.name = "method2", .klass = 1};
 static AllocationInfo aInfo1 { .ref = 100, .sizeBytes = 24 };
 static AllocationInfo aInfo2 { .ref = 101, .sizeBytes = 36 };
 
@@ -16,47 +17,261 @@ TEST(Storage, AddMethod) {
 }
 
 
+TEST(Storage, AddClass) {
+
+    Storage underTest;
+    underTest.AddMethod(1, methodInfo1);
+    underTest.AddMethod(2, methodInfo2);
+    underTest.AddClass(methodInfo1.klass, classInfo1);
+
+    EXPECT_TRUE(underTest.HasClass(1));
+    EXPECT_EQ(underTest.GetClass(underTest.GetMethod(1).klass).file, classInfo1.file);
+    EXPECT_EQ(underTest.GetClass(underTest.GetMethod(2).klass).signature, classInfo1.signature);
+    EXPECT_EQ(underTest.GetClass(2).file, "Unknown");
+    EXPECT_FALSE(underTest.HasClass(2));
+}
+
 TEST(Storage, AddAllocation) {
 
     Storage underTest;
     const auto methodId = 1;
-    const auto stackId = 2;
 
     underTest.AddMethod(methodId, methodInfo1);
 
     StackTrace st;
-    st.AddFrame(methodId);
+    st.AddFrame(methodId, 0);
+
+    const auto stackId = underTest.AddStackTrace(st);
+    underTest.AddAllocation(stackId, aInfo1);
 
-    underTest.AddAllocation(stackId, st, aInfo1);
+    EXPECT_EQ(underTest.GetStackTrace(stackId).GetFrames()[0].method, methodId);
+}
 
-    EXPECT_EQ(underTest.GetStackTrace(stackId).GetFrames()[0], methodId);
+static size_t countMethods(const Storage &storage) {
+    size_t methods = 0;
+    storage.ForEachMethod([&methods](uintptr_t, const MethodInfo &) { methods++; });
+    return methods;
 }
 
-TEST(Storage, Clear) {
+TEST(Storage, RotateDropsOldGenerations) {
 
     Storage underTest;
-    const auto stackId = 2;
 
-    underTest.AddMethod(1, methodInfo1);
-    underTest.AddMethod(2, methodInfo2);
+    // Ids 1 and 2 are the truncated and label frame markers
+    underTest.AddMethod(0x1000, methodInfo1);
+    underTest.AddMethod(0x2000, methodInfo2);
+    underTest.AddClass(1, classInfo1);
 
     StackTrace st;
-    st.AddFrame(1);
-    st.AddFrame(2);
-    st.AddFrame(1);
+    st.AddFrame(0x1000, 0);
+    st.AddFrame(0x2000, 0);
+    st.AddFrame(0x1000, 0);
 
-    underTest.AddAllocation(stackId, st, aInfo1);
-    underTest.AddAllocation(stackId, st, aInfo2);
+    const auto stackId = underTest.AddStackTrace(st);
+    underTest.AddAllocation(stackId, aInfo1);
+    underTest.AddAllocation(stackId, aInfo2);
 
     EXPECT_EQ(underTest.allocations.size(), 2);
-    EXPECT_EQ(underTest.methods.size(), 2);
+    EXPECT_EQ(countMethods(underTest), 2);
     EXPECT_EQ(underTest.GetStackTrace(stackId).GetFrames().size(), 3);
 
+    underTest.ClearAllocations();
+    underTest.Rotate();
+    underTest.Reclaim();
 
-    underTest.Clear();
+    // The previous generation stays for threads still sampling into it
+    EXPECT_EQ(underTest.Generations(), 2);
+    EXPECT_EQ(underTest.GetStackTrace(stackId).GetFrames().size(), 3);
+    EXPECT_EQ(countMethods(underTest), 2);
+
+    underTest.Rotate();
+    underTest.Reclaim();
+
+    // Methods sampled in the first window were carried to the second one
+    EXPECT_EQ(underTest.Generations(), 2);
+    EXPECT_EQ(underTest.GetStackTrace(stackId).GetFrames().size(), 0);
+    EXPECT_EQ(countMethods(underTest), 2);
+
+    underTest.Rotate();
+    underTest.Reclaim();
 
+    EXPECT_EQ(underTest.Generations(), 2);
     EXPECT_EQ(underTest.allocations.size(), 0);
-    EXPECT_EQ(underTest.methods.size(), 0);
+    EXPECT_EQ(countMethods(underTest), 0);
+    EXPECT_FALSE(underTest.HasClass(1));
     EXPECT_EQ(underTest.GetStackTrace(stackId).GetFrames().size(), 0);
+    EXPECT_EQ(underTest.GetMethod(0x1000).name, "Unknown");
+}
+
+TEST(Storage, RotateKeepsStacks) {
+
+    Storage underTest;
+
+    underTest.AddMethod(1, methodInfo1);
+    underTest.AddMethod(2, methodInfo2);
+    underTest.AddClass(1, classInfo1);
+    const auto labelSet = underTest.AddLabels({{"phase", "load"}});
+
+    StackTrace kept;
+    kept.AddFrame(1, 0);
+    kept.AddFrame(kLabelsMethod, labelSet);
+    StackTrace dropped;
+    dropped.AddFrame(2, 0);
+
+    const auto keptId = underTest.AddStackTrace(kept);
+    const auto droppedId = underTest.AddStackTrace(dropped);
+
+    underTest.Rotate({keptId});
+    underTest.Rotate({keptId});
+    underTest.Rotate({keptId});
+    underTest.Reclaim();
+
+    EXPECT_EQ(underTest.GetStackTrace(keptId).GetFrames().size(), 2);
+    EXPECT_EQ(underTest.GetStackTrace(droppedId).GetFrames().size(), 0);
+    EXPECT_EQ(underTest.GetMethod(1).name, methodInfo1.name);
+    EXPECT_EQ(underTest.GetClass(1).file, classInfo1.file);
+    EXPECT_EQ(underTest.GetMethod(2).name, "Unknown");
+    ASSERT_NE(underTest.GetLabels(labelSet), nullptr);
+    EXPECT_EQ(underTest.GetLabels(labelSet)->at(0).second, "load");
+    // Interning the same frames again gives the same id
+    EXPECT_EQ(underTest.AddStackTrace(kept), keptId);
+}
+
+TEST(Storage, RotateCarriesSampledMethods) {
+
+    Storage underTest;
+
+    underTest.AddClass(methodInfo1.klass, classInfo1);
+    underTest.AddMethod(1, methodInfo1);
+    underTest.AddMethod(2, methodInfo2);
+    underTest.AddMethod(3, methodInfo1);
+    StackTrace st;
+    st.AddFrame(1, 0);
+    underTest.AddStackTrace(st);
+    Frame path[] = {{3, 0}};
+    underTest.Calls().Intern(path, 1);
+    underTest.Rotate();
+
+    // Methods of stacks and call paths of the window, not the others
+    EXPECT_TRUE(underTest.HasMethod(1));
+    EXPECT_TRUE(underTest.HasMethod(3));
+    EXPECT_TRUE(underTest.HasClass(methodInfo1.klass));
+    EXPECT_FALSE(underTest.HasMethod(2));
+
+    underTest.AddStackTrace(st);
+    underTest.Rotate();
+    underTest.Reclaim();
+
+    EXPECT_EQ(underTest.Generations(), 2);
+    EXPECT_TRUE(underTest.HasMethod(1));
+    EXPECT_EQ(underTest.GetMethod(1).name, methodInfo1.name);
+    EXPECT_EQ(underTest.GetClass(underTest.GetMethod(1).klass).file, classInfo1.file);
+    EXPECT_EQ(underTest.GetMethod(2).name, "Unknown");
+}
+
+TEST(Storage, ReclaimWaitsForAnnouncedThreads) {
+
+    Storage underTest;
+    underTest.AddMethod(1, methodInfo1);
+
+    auto slot = underTest.epochs.Acquire();
+    underTest.epochs.Enter(*slot);
+
+    underTest.Rotate();
+    underTest.Rotate();
+    underTest.Reclaim();
+    EXPECT_EQ(underTest.Generations(), 3);
+    EXPECT_EQ(underTest.GetMethod(1).name, methodInfo1.name);
+
+    underTest.epochs.Exit(*slot);
+    underTest.Reclaim();
+    EXPECT_EQ(underTest.Generations(), 2);
+    EXPECT_EQ(underTest.GetMethod(1).name, "Unknown");
+    underTest.epochs.Release(slot);
+}
+
+TEST(Storage, ReclaimWaitsAcrossOtherEpochs) {
+
+    Storage underTest;
+    underTest.AddMethod(1, methodInfo1);
+
+    // Epochs advanced by something else while the first generation is current
+    underTest.epochs.Advance();
+    underTest.epochs.Advance();
+    auto slot = underTest.epochs.Acquire();
+    underTest.epochs.Enter(*slot);
+
+    underTest.Rotate();
+    underTest.Rotate();
+    underTest.Reclaim();
+    EXPECT_EQ(underTest.Generations(), 3);
+
+    underTest.epochs.Exit(*slot);
+    underTest.Reclaim();
+    EXPECT_EQ(underTest.Generations(), 2);
+    underTest.epochs.Release(slot);
+}
+
+TEST(Storage, CallTreesOfEveryGeneration) {
+
+    Storage underTest;
+    Frame frames[] = {{1, 0}};
+
+    underTest.Calls().AddAllocation(underTest.Calls().Intern(frames, 1), 16);
+    underTest.Rotate();
+    underTest.Calls().AddAllocation(underTest.Calls().Intern(frames, 1), 32);
+
+    double bytes = 0;
+    size_t trees = 0;
+    underTest.ForEachCallTree([&bytes, &trees](CallTree &calls) {
+        trees++;
+        calls.Drain([&bytes](long, const Estimate &alloc, const std::vector<Frame> &) {
+            bytes += alloc.Bytes();
+        });
+    });
+    EXPECT_EQ(trees, 2);
+    EXPECT_EQ(bytes, 48);
+    EXPECT_EQ(underTest.CallPaths(), 2);
+}
+
+TEST(Storage, ClearAllocationsKeepsMethods) {
+
+    Storage underTest;
+
+    underTest.AddMethod(1, methodInfo1);
+
+    StackTrace st;
+    st.AddFrame(1, 0);
+
+    const auto stackId = underTest.AddStackTrace(st);
+    underTest.AddAllocation(stackId, aInfo1);
+    underTest.ClearAllocations();
+
+    EXPECT_EQ(underTest.allocations.size(), 0);
+    EXPECT_TRUE(underTest.HasMethod(1));
+    EXPECT_EQ(underTest.GetStackTrace(stackId).GetFrames().size(), 1);
+}
+
+TEST(Storage, ClearAllocationsDropsFolded) {
+
+    Storage underTest;
+    underTest.folded[1].Add(aInfo1, 1, false, 0);
+    EXPECT_EQ(underTest.folded[1].alloc.Bytes(), 24);
+    underTest.ClearAllocations();
+
+    EXPECT_TRUE(underTest.folded.empty());
+}
+
+TEST(LineTable, LineOf) {
+
+    jvmtiLineNumberEntry entries[] = {{10, 21}, {0, 20}, {25, 23}};
+    LineTable underTest(entries, 3);
 
+    EXPECT_EQ(underTest.size(), 3);
+    EXPECT_EQ(underTest.LineOf(0), 20);
+    EXPECT_EQ(underTest.LineOf(9), 20);
+    EXPECT_EQ(underTest.LineOf(10), 21);
+    EXPECT_EQ(underTest.LineOf(24), 21);
+    EXPECT_EQ(underTest.LineOf(100), 23);
+    EXPECT_EQ(LineTable().LineOf(5), 0);
 }
@@ -0,0 +1,76 @@
+#ifndef THREAD_FILTER_H_
+#define THREAD_FILTER_H_
+
+// {{{ Includes
+#include <sstream>
+#include <string>
+#include <vector>
+//  }}}
+
+/**
+ * Decides which threads take sampled allocation events.
+ *
+ * Patterns are separated by '|' and match a thread name prefix, or a thread
+ * group name prefix when written as "group:<prefix>". A thread is accepted
+ * if it matches an include pattern, or there are none, and matches no
+ * exclude pattern.
+ */
+class ThreadFilter {
+public:
+  ThreadFilter() = default;
+  ThreadFilter(const std::string &include, const std::string &exclude)
+      : include_(Parse(include)), exclude_(Parse(exclude)) {}
+
+  bool Active() const { return !include_.empty() || !exclude_.empty(); }
+
+  // Whether Accepts needs the thread group name
+  bool NeedsGroup() const {
+    for (auto const *patterns : {&include_, &exclude_}) {
+      for (auto const &pattern : *patterns) {
+        if (pattern.group)
+          return true;
+      }
+    }
+    return false;
+  }
+
+  bool Accepts(const std::string &name, const std::string &group) const {
+    return (include_.empty() || Matches(include_, name, group)) &&
+           !Matches(exclude_, name, group);
+  }
+
+private:
+  struct Pattern {
+    std::string prefix;
+    bool group;
+  };
+
+  static std::vector<Pattern> Parse(const std::string &patterns) {
+    static const std::string kGroup = "group:";
+    std::vector<Pattern> parsed;
+    std::istringstream iss(patterns);
+    std::string pattern;
+    while (std::getline(iss, pattern, '|')) {
+      if (pattern.rfind(kGroup, 0) == 0)
+        parsed.push_back({pattern.substr(kGroup.size()), true});
+      else if (!pattern.empty())
+        parsed.push_back({pattern, false});
+    }
+    return parsed;
+  }
+
+  static bool Matches(const std::vector<Pattern> &patterns,
+                      const std::string &name, const std::string &group) {
+    for (auto const &pattern : patterns) {
+      auto &value = pattern.group ? group : name;
+      if (value.rfind(pattern.prefix, 0) == 0)
+        return true;
+    }
+    return false;
+  }
+
+  std::vector<Pattern> include_;
+  std::vector<Pattern> exclude_;
+};
+
+#endif // THREAD_FILTER_H_
@@ -0,0 +1,38 @@
+#include "gtest/gtest.h"
+#include "thread_filter.h"
+
+TEST(ThreadFilter, AcceptsEverythingByDefault) {
+
+    ThreadFilter underTest;
+    EXPECT_FALSE(underTest.Active());
+    EXPECT_TRUE(underTest.Accepts("main", "main"));
+}
+
+TEST(ThreadFilter, IncludesByNamePrefix) {
+
+    ThreadFilter underTest("http-nio|grpc-default-executor", "");
+    EXPECT_TRUE(underTest.Active());
+    EXPECT_FALSE(underTest.NeedsGroup());
+    EXPECT_TRUE(underTest.Accepts("http-nio-8080-exec-1", ""));
+    EXPECT_TRUE(underTest.Accepts("grpc-default-executor-3", ""));
+    EXPECT_FALSE(underTest.Accepts("main", ""));
+}
+
+TEST(ThreadFilter, ExcludesWin) {
+
+    ThreadFilter underTest("http-", "http-nio-8080-Acceptor");
+    EXPECT_TRUE(underTest.Accepts("http-nio-8080-exec-1", ""));
+    EXPECT_FALSE(underTest.Accepts("http-nio-8080-Acceptor", ""));
+
+    ThreadFilter excludeOnly("", "GC|C2 CompilerThread");
+    EXPECT_TRUE(excludeOnly.Accepts("main", ""));
+    EXPECT_FALSE(excludeOnly.Accepts("C2 CompilerThread0", ""));
+}
+
+TEST(ThreadFilter, MatchesThreadGroups) {
+
+    ThreadFilter underTest("group:workers", "");
+    EXPECT_TRUE(underTest.NeedsGroup());
+    EXPECT_TRUE(underTest.Accepts("pool-1-thread-1", "workers"));
+    EXPECT_FALSE(underTest.Accepts("workers", "main"));
+}
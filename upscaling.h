@@ -0,0 +1,57 @@
+#ifndef UPSCALING_H_
+#define UPSCALING_H_
+
+// {{{ Includes
+#include <cmath>
+//  }}}
+
+/**
+ * Estimates allocation totals from heap samples.
+ *
+ * The JVM samples a byte stream at exponentially distributed intervals, so an
+ * object of s bytes is sampled with probability 1 - exp(-s / interval) and a
+ * sample stands for the inverse of that many allocations, as in Go's heap
+ * profiles. Sums of such weights are unbiased estimates; their variance gives
+ * a normal approximation confidence interval.
+ */
+class Estimate {
+public:
+  Estimate() = default;
+  // Totals of samples weighted one by one elsewhere, as Add sums them
+  Estimate(double count, double bytes, double variance)
+      : count_(count), bytes_(bytes), variance_(variance) {}
+
+  // Number of allocations a sample stands for, 1 for an interval of 0
+  static double Weight(double sizeBytes, double intervalBytes) {
+    if (intervalBytes <= 0 || sizeBytes <= 0)
+      return 1;
+    return 1 / -std::expm1(-sizeBytes / intervalBytes);
+  }
+
+  /**
+   * Adds samples of sizeBytes each, taken at intervalBytes
+   *
+   * @param retained samples each one stands for after thinning
+   */
+  void Add(double sizeBytes, double intervalBytes, double retained = 1,
+           double samples = 1) {
+    auto weight = Weight(sizeBytes, intervalBytes) * retained;
+    count_ += samples * weight;
+    bytes_ += samples * weight * sizeBytes;
+    // Horvitz-Thompson variance, a sample is kept with probability 1 / weight
+    variance_ += samples * weight * (weight - 1) * sizeBytes * sizeBytes;
+  }
+
+  double Count() const { return count_; }
+  double Bytes() const { return bytes_; }
+  double Variance() const { return variance_; }
+  // Half width of the 95% confidence interval of Bytes
+  double BytesError() const { return 1.96 * std::sqrt(variance_); }
+
+private:
+  double count_ = 0;
+  double bytes_ = 0;
+  double variance_ = 0;
+};
+
+#endif // UPSCALING_H_
@@ -0,0 +1,58 @@
+#include "gtest/gtest.h"
+#include "upscaling.h"
+
+#include <random>
+
+TEST(Estimate, Weight) {
+
+    EXPECT_EQ(Estimate::Weight(16, 0), 1);
+    EXPECT_NEAR(Estimate::Weight(1 << 20, 1024), 1, 1e-9);
+    // small objects are rarely sampled, each sample stands for about interval / size
+    EXPECT_NEAR(Estimate::Weight(16, 1024), 64.5, 0.1);
+}
+
+TEST(Estimate, RawWithoutInterval) {
+
+    Estimate underTest;
+    underTest.Add(16, 0);
+    underTest.Add(32, 0, 1, 2);
+
+    EXPECT_EQ(underTest.Count(), 3);
+    EXPECT_EQ(underTest.Bytes(), 80);
+    EXPECT_EQ(underTest.BytesError(), 0);
+}
+
+TEST(Estimate, UnbiasedForSmallAndLargeObjects) {
+
+    // Sample a stream of allocations the way the JVM does
+    const double interval = 4096;
+    std::mt19937_64 random(42);
+    std::exponential_distribution<double> next(1 / interval);
+    double untilSample = next(random);
+    Estimate small, large;
+    for (int i = 0; i < 1000000; i++) {
+        for (auto [size, estimate] : {std::pair{24.0, &small}, std::pair{8192.0, &large}}) {
+            untilSample -= size;
+            if (untilSample > 0)
+                continue;
+            while (untilSample <= 0)
+                untilSample += next(random);
+            estimate->Add(size, interval);
+        }
+    }
+
+    EXPECT_NEAR(small.Bytes(), 24e6, small.BytesError());
+    EXPECT_NEAR(small.Count(), 1e6, 0.05e6);
+    EXPECT_NEAR(large.Bytes(), 8192e6, large.BytesError());
+    EXPECT_LT(small.BytesError(), 0.05 * small.Bytes());
+}
+
+TEST(Estimate, RetainedSamples) {
+
+    Estimate underTest;
+    underTest.Add(16, 0, 4);
+
+    EXPECT_EQ(underTest.Count(), 4);
+    EXPECT_EQ(underTest.Bytes(), 64);
+    EXPECT_GT(underTest.BytesError(), 0);
+}